@@ -0,0 +1,150 @@
+// Checks the recovery journal of a big buffer: a snapshot (checkpoint) is
+// written by slices while lines are edited and blocks are packed between
+// the slices, then a second buffer recovers the file from the journal
+// and must hold the same lines. A file mixing CR LF and LF ends of line
+// must be saved byte for byte after a recovery. Results are printed on
+// Serial.
+#include <LittleFS.h>
+#include <TinyVim.h>
+
+using tiny_vim::Buffer;
+
+static constexpr uint32_t lines = 20000;  // packed: more than pack_min
+
+static uint16_t failed = 0;
+
+static void check(bool ok, const char* what, long value)
+{
+  if (not ok) failed++;
+  Serial.print(ok ? "PASS " : "FAIL ");
+  Serial.print(what);
+  Serial.print(' ');
+  Serial.println(value);
+}
+
+static void load(Buffer& buff, bool recover)
+{
+  buff.setFileName("/checkpoint.txt");
+  buff.load("/checkpoint.txt");
+  uint8_t progress;
+  while(buff.ioSlice(millis()+20, progress));
+  buff.openJournal(recover);
+}
+
+static std::string content(const Buffer& buff)
+{
+  std::string text;
+  for(uint32_t row=1; row<=buff.lines(); row++)
+  {
+    text += buff.getLine(row);
+    text += '\n';
+    buff.releaseBlocks();
+  }
+  return text;
+}
+
+static void write(bool mixed)
+{
+  File file = LittleFS.open("/checkpoint.txt", "w");
+  char line[48];
+  for(uint32_t n=1; n<=lines; n++)
+  {
+    snprintf(line, sizeof(line), "line %05lu of the checkpoint test", (unsigned long)n);
+    file.print(line);
+    file.print(mixed and n % 3 == 0 ? "\r\n" : "\n");
+  }
+  file.close();
+  LittleFS.remove("/checkpoint.txt.swp");
+}
+
+static std::string save(Buffer& buff, const char* name)
+{
+  LittleFS.remove(name);
+  uint8_t progress;
+  if (buff.save(name, false))
+    while(buff.ioSlice(millis()+20, progress));
+  std::string bytes;
+  File file = LittleFS.open(name, "r");
+  while(file.available()) bytes += (char)file.read();
+  file.close();
+  LittleFS.remove(name);
+  return bytes;
+}
+
+// Packs the buffer before and between the slices of a checkpoint
+static void packed()
+{
+  write(false);
+  std::string expected;
+  {
+    Buffer buff;
+    load(buff, false);
+    buff.takeLine(5) = "changed before";
+    buff.journal(true);
+    buff.pack(millis()+1000);
+    buff.getLine(lines/2);  // loads its block
+    check(buff.startCheckpoint(), "checkpoint started", 0);
+    uint8_t progress;
+    uint32_t slices = 0;
+    while(buff.checkpoint(millis(), progress))
+    {
+      if (++slices == 10)
+      {
+        buff.takeLine(3) = "changed, written";
+        buff.takeLine(lines-10) = "changed, not written yet";
+        buff.journal(true);
+      }
+      buff.pack(millis()+1);
+      buff.releaseBlocks();
+    }
+    Serial.print("# slices ");
+    Serial.println(slices);
+    buff.takeLine(10) = "changed after";
+    buff.journal(true);
+    expected = content(buff);
+  }
+  Buffer recovered;
+  load(recovered, true);
+  check(content(recovered) == expected, "recovered lines", recovered.lines());
+  recovered.closeJournal();
+}
+
+// Recovers a mixed CR LF / LF file from a snapshot, then saves it
+static void mixed()
+{
+  write(true);
+  std::string expected;
+  {
+    Buffer buff;
+    load(buff, false);
+    buff.takeLine(3) = "changed, CR LF";
+    buff.takeLine(4) = "changed, LF";
+    buff.journal(true);
+    uint8_t progress;
+    buff.startCheckpoint();
+    while(buff.checkpoint(millis()+1, progress));
+    buff.takeLine(6) = "changed after, CR LF";
+    buff.journal(true);
+    expected = save(buff, "/expected.txt");
+  }
+  Buffer recovered;
+  load(recovered, true);
+  std::string bytes = save(recovered, "/recovered.txt");
+  check(expected.find("CR LF\r\n") != std::string::npos and expected.find("LF\n") != std::string::npos, "mixed ends of line", expected.length());
+  check(bytes == expected, "recovered bytes", bytes.length());
+  recovered.closeJournal();
+}
+
+void setup()
+{
+  Serial.begin(115200);
+  LittleFS.begin(true);
+  packed();
+  mixed();
+  LittleFS.remove("/checkpoint.txt");
+  Serial.println(failed ? "# FAILED" : "# ALL PASSED");
+}
+
+void loop()
+{
+}
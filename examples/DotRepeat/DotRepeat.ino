@@ -0,0 +1,80 @@
+// Checks that '.' repeats the changes of normal and visual modes.
+// Each case types keys in a Vim editing /dot.txt, writes the file and
+// compares it with the expected text. Results are printed on Serial.
+#include <LittleFS.h>
+#include <TinyVim.h>
+
+#define ESC "\x1b"
+#define CTRL_V "\x16"
+
+static const char* text =
+  "one two three four\n"
+  "five six seven eight\n"
+  "nine ten eleven twelve\n"
+  "alpha beta gamma delta\n";
+
+struct Case
+{
+  const char* keys;
+  const char* expected;
+};
+
+static const Case cases[] = {
+  { "dw.",           "three four\nfive six seven eight\nnine ten eleven twelve\nalpha beta gamma delta\n" },
+  { "x3.",           "two three four\nfive six seven eight\nnine ten eleven twelve\nalpha beta gamma delta\n" },
+  { "cwONE" ESC "w.", "ONE ONE three four\nfive six seven eight\nnine ten eleven twelve\nalpha beta gamma delta\n" },
+  { "ddj.",          "five six seven eight\nalpha beta gamma delta\n" },
+  // visual: as many lines, chars or columns from the cursor
+  { "vjd.",          "ine ten eleven twelve\nalpha beta gamma delta\n" },
+  { "vlld.",         "o three four\nfive six seven eight\nnine ten eleven twelve\nalpha beta gamma delta\n" },
+  { "vllcX" ESC "w.", "X X three four\nfive six seven eight\nnine ten eleven twelve\nalpha beta gamma delta\n" },
+  { "Vj>j.",         "\tone two three four\n\t\tfive six seven eight\n\tnine ten eleven twelve\nalpha beta gamma delta\n" },
+  { CTRL_V "jlldj.",  " two three four\nix seven eight\ne ten eleven twelve\nalpha beta gamma delta\n" },
+  { CTRL_V "jjlllcZ" ESC "jw.", "Ztwo three four\n six Zn eight\n ten en twelve\nalphaa gamma delta\n" },
+  // insert: Ctrl-V inserts the next key as is
+  { "i" CTRL_V ESC "Y" ESC "j0.", "\x1bYone two three four\n\x1bYfive six seven eight\nnine ten eleven twelve\nalpha beta gamma delta\n" },
+};
+
+static void type(TinyVim& vim, const char* keys)
+{
+  while(*keys) vim.onKey((TinyTerm::KeyCode)(uint8_t)*keys++);
+  do vim.loop(); while(vim.busy());
+}
+
+static std::string run(const char* keys)
+{
+  File file = LittleFS.open("/dot.txt", "w");
+  file.print(text);
+  file.close();
+  {
+    tiny_bash::TinyEnv env;
+    TinyVim vim(&Term, env, "/dot.txt");
+    type(vim, "");
+    type(vim, keys);
+    type(vim, ESC ":x\r");
+  }
+  std::string result;
+  file = LittleFS.open("/dot.txt", "r");
+  while(file.available()) result += (char)file.read();
+  file.close();
+  return result;
+}
+
+void setup()
+{
+  Serial.begin(115200);
+  LittleFS.begin(true);
+  uint16_t failed = 0;
+  for(const Case& test: cases)
+  {
+    bool ok = run(test.keys) == test.expected;
+    if (not ok) failed++;
+    Serial.print(ok ? "PASS " : "FAIL ");
+    Serial.println(test.keys);
+  }
+  Serial.println(failed ? "# FAILED" : "# ALL PASSED");
+}
+
+void loop()
+{
+}
@@ -0,0 +1,107 @@
+// Stress test: opens a file of one million lines, as a read only view
+// (-R) and, where the memory allows it, as an edited buffer.
+// Checks the load time, the memory used and the lines found by G and
+// 500000G. The file takes 8 MB of the file system.
+#include <LittleFS.h>
+#include <TinyVim.h>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+static constexpr uint32_t lines = 1000000;
+#if defined(ESP32) or defined(ESP8266)
+static constexpr bool edit = false;             // 1M strings do not fit
+static constexpr uint32_t max_load_ms = 120000; // bound by the flash reads
+#else
+static constexpr bool edit = true;
+static constexpr uint32_t max_load_ms = 5000;
+#endif
+static constexpr uint32_t max_view_bytes = 32768;  // the Vim session with its view
+static constexpr uint32_t max_edit_bytes_per_line = 48;
+
+static long heapUsed()
+{
+#if defined(ESP32) or defined(ESP8266)
+  return -(long)ESP.getFreeHeap();
+#elif defined(__GLIBC__)
+  struct mallinfo2 info = mallinfo2();
+  return info.uordblks + info.hblkhd;
+#else
+  return 0;
+#endif
+}
+
+static char* lineOf(uint32_t n, char* buf)  // 1 based
+{
+  snprintf(buf, 16, "%07lu", (unsigned long)n-1);
+  return buf;
+}
+
+static uint16_t failed = 0;
+
+static void check(bool ok, const char* what, long value)
+{
+  if (not ok) failed++;
+  Serial.print(ok ? "PASS " : "FAIL ");
+  Serial.print(what);
+  Serial.print(' ');
+  Serial.println(value);
+}
+
+static void type(TinyVim& vim, const char* keys)
+{
+  while(*keys) vim.onKey((TinyTerm::KeyCode)(uint8_t)*keys++);
+  do vim.loop(); while(vim.busy());
+}
+
+static void run(const char* args, const char* mode)
+{
+  Serial.print("# ");
+  Serial.println(mode);
+  char expected[16];
+  long heap = heapUsed();
+  uint32_t start = millis();
+  {
+    tiny_bash::TinyEnv env;
+    TinyVim vim(&Term, env, args);
+    type(vim, "");
+    uint32_t load_ms = millis()-start;
+    long bytes = heapUsed()-heap;
+    check(load_ms <= max_load_ms, "load ms", load_ms);
+    if (edit and mode[0] == 'e')
+      check(bytes <= (long)(max_edit_bytes_per_line*lines), "bytes", bytes);
+    else
+      check(bytes <= (long)max_view_bytes, "bytes", bytes);
+
+    type(vim, "Gyy");
+    check(vim.clipboard() == std::string(lineOf(lines, expected)) + '\r', "G", lines);
+    type(vim, "500000Gyy");
+    check(vim.clipboard() == std::string(lineOf(500000, expected)) + '\r', "500000G", 500000);
+    type(vim, "ggyy");
+    check(vim.clipboard() == std::string(lineOf(1, expected)) + '\r', "gg", 1);
+    type(vim, "\x03");  // Ctrl-C
+  }
+}
+
+void setup()
+{
+  Serial.begin(115200);
+  LittleFS.begin(true);
+  File file = LittleFS.open("/huge.txt", "w");
+  char line[16];
+  for(uint32_t n=1; n<=lines; n++)
+  {
+    file.print(lineOf(n, line));
+    file.print('\n');
+  }
+  file.close();
+
+  run("-R /huge.txt", "view");
+  if (edit) run("/huge.txt", "edit");
+  LittleFS.remove("/huge.txt");
+  Serial.println(failed ? "# FAILED" : "# ALL PASSED");
+}
+
+void loop()
+{
+}
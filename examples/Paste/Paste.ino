@@ -0,0 +1,151 @@
+// Checks pastes into insert mode. Keys typed faster than the paste gap
+// are inserted at once, the first one included, with no autoindent;
+// keys typed slowly keep it. A Vim reading its keys from a link enables
+// bracketed paste: the text between the markers is inserted as is, even
+// in normal mode. Each case saves /paste.txt and compares it with the
+// expected text. Results are printed on Serial.
+#include <LittleFS.h>
+#include <TinyVim.h>
+
+#define ESC "\x1b"
+
+static constexpr uint16_t paste_lines = 500;
+static constexpr uint32_t max_paste_ms = 1000;
+
+static uint16_t failed = 0;
+
+static void check(bool ok, const char* what, long value)
+{
+  if (not ok) failed++;
+  Serial.print(ok ? "PASS " : "FAIL ");
+  Serial.print(what);
+  Serial.print(' ');
+  Serial.println(value);
+}
+
+// Both ends of a terminal in memory: keys are written to input, what the
+// session sends is collected in output
+struct Pipe : public Stream
+{
+  std::string input;
+  std::string output;
+  size_t write(uint8_t c) override { output += (char)c; return 1; }
+  int available() override { return input.length(); }
+  int read() override { int c = peek(); if (c >= 0) input.erase(0, 1); return c; }
+  int peek() override { return input.empty() ? -1 : (uint8_t)input[0]; }
+};
+
+static void idle(TinyVim& vim, uint32_t ms = 20)
+{
+  uint32_t start = millis();
+  do vim.loop(); while(vim.busy() or millis()-start < ms);
+}
+
+static void fast(TinyVim& vim, const char* keys)
+{
+  while(*keys) vim.onKey((TinyTerm::KeyCode)(uint8_t)*keys++);
+  idle(vim);
+}
+
+static void slow(TinyVim& vim, const char* keys)
+{
+  while(*keys)
+  {
+    vim.onKey((TinyTerm::KeyCode)(uint8_t)*keys++);
+    idle(vim, 10);
+  }
+}
+
+static void writeFile(const char* text)
+{
+  File file = LittleFS.open("/paste.txt", "w");
+  file.print(text);
+  file.close();
+}
+
+static std::string readFile()
+{
+  std::string text;
+  File file = LittleFS.open("/paste.txt", "r");
+  while(file.available()) text += (char)file.read();
+  file.close();
+  return text;
+}
+
+static void timed()
+{
+  tiny_bash::TinyEnv env;
+  writeFile("\tfoo\n");
+  {
+    TinyVim vim(&Term, env, "/paste.txt");
+    idle(vim);
+    slow(vim, ":set ai\r" "$a\rbar" ESC ":x\r");
+  }
+  check(readFile() == "\tfoo\n\tbar\n", "typed keys are indented", 0);
+
+  writeFile("\tfoo\n");
+  {
+    TinyVim vim(&Term, env, "/paste.txt");
+    idle(vim);
+    slow(vim, ":set ai\r" "$a");
+    fast(vim, "\rbar\rbaz");  // the first key belongs to the paste
+    slow(vim, ESC ":x\r");
+  }
+  check(readFile() == "\tfoo\nbar\nbaz\n", "pasted keys are not indented", 0);
+
+  writeFile("");
+  std::string text;
+  for(uint16_t n=1; n<=paste_lines; n++)
+    text += "line " + std::to_string(n) + " of the text pasted at once\r";
+  {
+    TinyVim vim(&Term, env, "/paste.txt");
+    idle(vim);
+    slow(vim, "i");
+    uint32_t start = millis();
+    fast(vim, text.c_str());
+    uint32_t ms = millis()-start;
+    check(ms <= max_paste_ms, "ms to paste 500 lines", ms);
+    slow(vim, ESC ":x\r");
+  }
+  std::string expected;  // a new file is CR LF
+  for(char c: text) expected += c == '\r' ? std::string("\r\n") : std::string(1, c);
+  check(readFile() == expected + "\r\n", "pasted lines", paste_lines);
+}
+
+static void bracketed()
+{
+  tiny_bash::TinyEnv env;
+  Pipe pipe;
+  tiny_vim::Transport link(pipe, tiny_vim::Transport::serial_link);
+  TinyTerm term(link);
+  writeFile("\tfoo\n");
+  {
+    TinyVim vim(&term, env, "/paste.txt", &link);
+    idle(vim);
+    check(pipe.output.find("\x1b[?2004h") != std::string::npos, "bracketed paste enabled", 0);
+    pipe.input = ":set ai\r";
+    idle(vim);
+    pipe.input = "$a\x1b[200~\r\nbar\nbaz\x1b[201~" ESC;  // LF and CR LF
+    idle(vim);
+    pipe.input = "gg0\x1b[200~ddx\x1b[201~";  // normal mode: inserted
+    idle(vim);
+    pipe.input = ":x\r";
+    idle(vim);
+  }
+  check(pipe.output.find("\x1b[?2004l") != std::string::npos, "bracketed paste disabled", 0);
+  check(readFile() == "ddx\tfoo\nbar\nbaz\n", "bracketed text", 0);
+}
+
+void setup()
+{
+  Serial.begin(115200);
+  LittleFS.begin(true);
+  timed();
+  bracketed();
+  LittleFS.remove("/paste.txt");
+  Serial.println(failed ? "# FAILED" : "# ALL PASSED");
+}
+
+void loop()
+{
+}
@@ -0,0 +1,120 @@
+// Runs a Vim over a loopback telnet connection, driven by a scripted
+// client in the same sketch. Checks the telnet negotiation, measures the
+// keystroke to echo latency and the packets sent per key, then saves
+// /latency.txt and checks the typed text. Results are printed on Serial.
+#include <LittleFS.h>
+#if defined(ESP8266)
+#include <ESP8266WiFi.h>
+#else
+#include <WiFi.h>
+#endif
+#include <TinyVim.h>
+
+static const char* ssid = "ssid";
+static const char* password = "password";
+static constexpr uint16_t port = 2323;
+static constexpr uint16_t keys = 50;
+static constexpr char typed = 'Q';  // found nowhere else in the frame
+static constexpr uint32_t max_latency_us = 30000;  // a partial packet waits 20 ms
+static constexpr uint32_t packets_per_key = 2;
+
+static uint16_t failed = 0;
+
+static void check(bool ok, const char* what, long value)
+{
+  if (not ok) failed++;
+  Serial.print(ok ? "PASS " : "FAIL ");
+  Serial.print(what);
+  Serial.print(' ');
+  Serial.println(value);
+}
+
+// Runs the session for ms, the client collects what it receives
+static void pump(TinyVim& vim, WiFiClient& client, std::string& received, uint32_t ms)
+{
+  uint32_t start = millis();
+  do
+  {
+    vim.loop();
+    while(client.available() > 0) received += (char)client.read();
+  } while(millis()-start < ms);
+}
+
+static void send(WiFiClient& client, const char* bytes)
+{
+  client.write((const uint8_t*)bytes, strlen(bytes));
+}
+
+void setup()
+{
+  Serial.begin(115200);
+  LittleFS.begin(true);
+  LittleFS.remove("/latency.txt");
+  WiFi.mode(WIFI_STA);
+  WiFi.begin(ssid, password);
+  while(WiFi.status() != WL_CONNECTED) delay(100);
+
+  WiFiServer server(port);
+  server.begin();
+  WiFiClient client;
+  if (not client.connect("127.0.0.1", port))
+  {
+    Serial.println("# FAILED to connect");
+    return;
+  }
+  client.setNoDelay(true);
+  WiFiClient remote;
+  while(not (remote = server.available())) delay(1);
+  remote.setNoDelay(true);
+
+  send(client, "\x1b[24;80R");  // answers the size query of the session
+  tiny_vim::Transport link(remote, tiny_vim::Transport::telnet_link);
+  TinyTerm term(link);
+  {
+    tiny_bash::TinyEnv env;
+    TinyVim vim(&term, env, "/latency.txt", &link);
+    std::string received;
+    pump(vim, client, received, 50);
+    check(received.find("\xFF\xFB\x01") != std::string::npos, "WILL ECHO", 1);
+    check(received.find("\xFF\xFB\x03") != std::string::npos, "WILL SGA", 3);
+
+    send(client, "\xFF\xFD\x01\xFF\xFD\x03");  // DO ECHO, DO SGA
+    send(client, "i");
+    pump(vim, client, received, 50);
+
+    uint32_t total_us = 0;
+    uint32_t worst_us = 0;
+    uint32_t packets = link.packets();
+    for(uint16_t n=0; n<keys; n++)
+    {
+      received.clear();
+      uint32_t start = micros();
+      client.write((uint8_t)typed);
+      while(received.find(typed) == std::string::npos and micros()-start < 1000000)
+        pump(vim, client, received, 0);
+      uint32_t us = micros()-start;
+      total_us += us;
+      if (us > worst_us) worst_us = us;
+      pump(vim, client, received, 10);  // the rest of the frame
+    }
+    check(total_us/keys <= max_latency_us, "average us", total_us/keys);
+    Serial.print("# worst us ");
+    Serial.println(worst_us);
+    packets = link.packets()-packets;
+    check(packets <= packets_per_key*keys, "packets", packets);
+
+    send(client, "\x1b:x\r");
+    pump(vim, client, received, 50);
+  }
+  std::string text;
+  File file = LittleFS.open("/latency.txt", "r");
+  while(file.available()) text += (char)file.read();
+  file.close();
+  check(text == std::string(keys, typed) + "\r\n", "text bytes", text.length());  // new files are CR LF
+  LittleFS.remove("/latency.txt");
+  Serial.println(failed ? "# FAILED" : "# ALL PASSED");
+}
+
+void loop()
+{
+}
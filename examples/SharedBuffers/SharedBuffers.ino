@@ -0,0 +1,114 @@
+// Two Vim sessions on the same file share one buffer. Checks that the
+// second session costs little memory, that an edit made in one session
+// is seen by the other, and that :w refuses to replace a file changed on
+// disk since it was read, while :w! replaces it. Results are printed on
+// Serial.
+#include <LittleFS.h>
+#include <TinyVim.h>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+#define ESC "\x1b"
+
+static constexpr uint16_t lines = 1000;  // 50 KB
+static constexpr long max_shared_bytes = 8192;  // the second session
+
+static long heapUsed()
+{
+#if defined(ESP32) or defined(ESP8266)
+  return -(long)ESP.getFreeHeap();
+#elif defined(__GLIBC__)
+  struct mallinfo2 info = mallinfo2();
+  return info.uordblks + info.hblkhd;
+#else
+  return 0;
+#endif
+}
+
+static uint16_t failed = 0;
+
+static void check(bool ok, const char* what, long value)
+{
+  if (not ok) failed++;
+  Serial.print(ok ? "PASS " : "FAIL ");
+  Serial.print(what);
+  Serial.print(' ');
+  Serial.println(value);
+}
+
+static void type(TinyVim& vim, const char* keys)
+{
+  while(*keys) vim.onKey((TinyTerm::KeyCode)(uint8_t)*keys++);
+  do vim.loop(); while(vim.busy());
+}
+
+static void writeFile(const char* text)
+{
+  File file = LittleFS.open("/shared.txt", "w");
+  file.print(text);
+  file.close();
+}
+
+static std::string readFile()
+{
+  std::string text;
+  File file = LittleFS.open("/shared.txt", "r");
+  while(file.available()) text += (char)file.read();
+  file.close();
+  return text;
+}
+
+void setup()
+{
+  Serial.begin(115200);
+  LittleFS.begin(true);
+  File file = LittleFS.open("/shared.txt", "w");
+  for(uint16_t n=1; n<=lines; n++)
+  {
+    char line[64];
+    snprintf(line, sizeof(line), "%04u the quick brown fox jumps over the lazy dog\n", n);
+    file.print(line);
+  }
+  file.close();
+  {
+    tiny_bash::TinyEnv env;
+    long heap = heapUsed();
+    TinyVim serial(&Term, env, "/shared.txt");
+    type(serial, "");
+    long first = heapUsed()-heap;
+    heap = heapUsed();
+    TinyVim telnet(&Term, env, "/shared.txt");
+    type(telnet, "");
+    long second = heapUsed()-heap;
+    Serial.print("# first session bytes ");
+    Serial.println(first);
+    check(second <= max_shared_bytes, "second session bytes", second);
+
+    type(serial, "ddcwFIRST" ESC);
+    type(telnet, "yy");
+    check(telnet.clipboard() == "FIRST the quick brown fox jumps over the lazy dog\r", "edit seen", 1);
+    type(telnet, "Gdd");
+    type(serial, "Gyy");
+    check(serial.clipboard() == "0999 the quick brown fox jumps over the lazy dog\r", "edit seen back", lines-1);
+
+    type(serial, ":w\r");
+    std::string saved = readFile();
+    check(saved.compare(0, 6, "FIRST ") == 0, ":w", saved.length());
+
+    writeFile("changed on disk\n");
+    type(telnet, "ggx:w\r");
+    check(readFile() == "changed on disk\n", ":w refused", 0);
+    type(telnet, ":w!\r");
+    saved = readFile();
+    check(saved.compare(0, 6, "IRST t") == 0, ":w! writes", saved.length());
+    type(serial, ":q!\r");
+    type(telnet, ":q!\r");
+  }
+  LittleFS.remove("/shared.txt");
+  Serial.println(failed ? "# FAILED" : "# ALL PASSED");
+}
+
+void loop()
+{
+}
@@ -3,10 +3,203 @@
 #include <TinyStreaming.h>
 #include <TinyTerm.h>
 #include "TinyVim.h"
+#include <cstring>
+#include <limits>
+#include <string_view>
 
 namespace tiny_vim
 {
 
+static constexpr const char* reverse_video = "\033[7m";
+static constexpr const char* normal_video = "\033[27m";
+
+static inline bool isUtf8Cont(char c) { return (c & 0xC0) == 0x80; }
+
+// Display width of byte c at display column col
+static inline bool isControl(char c) { return (uint8_t)c < ' ' or c == 127; }
+
+static inline uint16_t charWidth(char c, uint16_t col, uint8_t ts)
+{
+  if (c == '\t') return ts - col % ts;
+  if (isControl(c)) return 2;  // ^@
+  return isUtf8Cont(c) ? 0 : 1;
+}
+
+// Byte index (0 based) of next / previous char (UTF-8)
+static size_t nextChar(std::string_view s, size_t i)
+{
+  if (i < s.length()) i++;
+  while(i < s.length() and isUtf8Cont(s[i])) i++;
+  return i;
+}
+
+static size_t prevChar(std::string_view s, size_t i)
+{
+  if (i > 0) i--;
+  while(i > 0 and isUtf8Cont(s[i])) i--;
+  return i;
+}
+
+static Cursor::type firstNonBlank(std::string_view line)
+{
+  size_t col = line.find_first_not_of(" \t");
+  return col == std::string_view::npos ? 1 : col+1;
+}
+
+// Motion kernels: a position and a count in, the new position out.
+// They read lines through string_views and allocate nothing.
+
+// Word classes: 0 blank (or end of line), 1 punctuation, 2 word (WORD if big)
+static uint8_t charClass(std::string_view s, size_t i, bool big)
+{
+  if (i >= s.length() or s[i] == ' ' or s[i] == '\t') return 0;
+  unsigned char c = s[i];
+  return big or isalnum(c) or c == '_' or (c & 0x80) ? 2 : 1;
+}
+
+// Walks the chars of a buffer, the end of each line is a blank
+struct TextWalker
+{
+  const Buffer& buff;
+  Cursor::type row;
+  std::string_view line;
+  size_t col;  // byte, line.length() at the end of the line
+
+  TextWalker(const Buffer& buff, const Cursor& c)
+  : buff(buff), row(c.row), line(buff.getLine(c.row)), col(std::min<size_t>(c.col-1, line.length())) {}
+  bool next()  // false at the end of the buffer
+  {
+    if (col < line.length()) { col = nextChar(line, col); return true; }
+    if (row >= buff.lines()) return false;
+    line = buff.getLine(++row);
+    col = 0;
+    return true;
+  }
+  bool prev()  // false at the start of the buffer
+  {
+    if (col > 0) { col = prevChar(line, col); return true; }
+    if (row <= 1) return false;
+    line = buff.getLine(--row);
+    col = line.length();
+    return true;
+  }
+  uint8_t cls(bool big) const { return charClass(line, col, big); }
+  Cursor cursor() const { return Cursor(row, col+1); }
+};
+
+// w W: start of the next word, an empty line is a word
+static Cursor wordForward(const Buffer& buff, const Cursor& from, uint32_t count, bool big)
+{
+  TextWalker w(buff, from);
+  while(count--)
+  {
+    uint8_t cls = w.cls(big);
+    while(cls and w.cls(big) == cls) w.next();
+    while(w.cls(big) == 0)
+    {
+      Cursor::type row = w.row;
+      if (not w.next()) return w.cursor();
+      if (w.row != row and w.line.empty()) break;
+    }
+  }
+  return w.cursor();
+}
+
+// b B: start of the previous word
+static Cursor wordBackward(const Buffer& buff, const Cursor& from, uint32_t count, bool big)
+{
+  TextWalker w(buff, from);
+  while(count--)
+  {
+    if (not w.prev()) break;
+    while(w.cls(big) == 0 and not w.line.empty())
+      if (not w.prev()) return w.cursor();
+    uint8_t cls = w.cls(big);
+    while(cls and w.col > 0 and charClass(w.line, prevChar(w.line, w.col), big) == cls)
+      w.col = prevChar(w.line, w.col);
+  }
+  return w.cursor();
+}
+
+// e E: end of the word (the next one if already there)
+static Cursor wordEnd(const Buffer& buff, const Cursor& from, uint32_t count, bool big)
+{
+  TextWalker w(buff, from);
+  while(count--)
+  {
+    if (not w.next()) break;
+    while(w.cls(big) == 0)
+      if (not w.next()) return w.cursor();
+    uint8_t cls = w.cls(big);
+    size_t next;
+    while((next = nextChar(w.line, w.col)) < w.line.length() and charClass(w.line, next, big) == cls)
+      w.col = next;
+  }
+  return w.cursor();
+}
+
+// f F t T: count-th c of the line, t stops before it.
+// again: a repeated t skips the c next to the cursor
+static bool findInLine(std::string_view line, size_t& col, char c, bool forward, bool till, bool again, uint32_t count)
+{
+  size_t i = col;
+  if (till and again)
+  {
+    if (forward and i+1 < line.length() and line[i+1] == c) i++;
+    if (not forward and i > 0 and line[i-1] == c) i--;
+  }
+  while(count--)
+  {
+    if (forward)
+      i = i+1 < line.length() ? line.find(c, i+1) : std::string_view::npos;
+    else
+      i = i > 0 ? line.rfind(c, i-1) : std::string_view::npos;
+    if (i == std::string_view::npos) return false;
+  }
+  col = till ? (forward ? prevChar(line, i) : nextChar(line, i)) : i;
+  return true;
+}
+
+// %: from the bracket under or after the cursor to its match
+static bool matchPair(const Buffer& buff, Cursor& cur)
+{
+  static constexpr const char* pairs = "()[]{}";
+  std::string_view line = buff.getLine(cur.row);
+  size_t col = cur.col-1;
+  const char* p = nullptr;
+  while(col < line.length() and (line[col] == 0 or (p = strchr(pairs, line[col])) == nullptr)) col++;
+  if (p == nullptr) return false;
+  bool forward = (p-pairs) % 2 == 0;
+  char up = *p;
+  char down = forward ? p[1] : p[-1];
+  int32_t depth = 0;
+  TextWalker w(buff, Cursor(cur.row, col+1));
+  do
+  {
+    if (w.col >= w.line.length()) continue;
+    if (w.line[w.col] == up)
+      depth++;
+    else if (w.line[w.col] == down and --depth == 0)
+    {
+      cur = w.cursor();
+      return true;
+    }
+  } while(forward ? w.next() : w.prev());
+  return false;
+}
+
+// } {: count-th empty line after (before) a paragraph
+static Cursor::type paragraph(const Buffer& buff, Cursor::type row, uint32_t count, int8_t dir)
+{
+  Cursor::type last = buff.lines();
+  while(count--)
+  {
+    while(row+dir >= 1 and row+dir <= last and buff.getLine(row).empty()) row += dir;
+    while(row+dir >= 1 and row+dir <= last and not buff.getLine(row).empty()) row += dir;
+  }
+  return row;
+}
+
 static std::map<std::string, int> pos;
 void vim_debug(std::string key)
 {
@@ -65,12 +258,146 @@ int16_t getIndex(const char* haystack, const char* needle)
 
 Action Vim::getAction(const char* action)
 {
+  if (action[0] == ',' and action[1] == 0) return Action::VIM_FIND_REVERSE;
   int16_t index=getIndex(actions, action);
   if (index==-1) return Action::VIM_UNKNOWN;
   if (index==-2) return Action::VIM_UNTERMINATED;
   return (Action)index;
 }
 
+using Set = VimSettings;
+static constexpr Set::Decl setting_decls[] = {
+//  name              abbrev  type         scope       value                 default
+  { "scrolloff",      "so",   Set::NUMBER,  Set::GLOBAL, &Set::scrolloff,      nullptr, 5, nullptr },
+  { "sidescrolloff",  "siso", Set::NUMBER,  Set::GLOBAL, &Set::sidescrolloff,  nullptr, 0, nullptr },
+  { "tabstop",        "ts",   Set::NUMBER,  Set::BUFFER, &Set::ts,             nullptr, 2, nullptr },
+  { "wrap",           "wrap", Set::BOOLEAN, Set::GLOBAL, &Set::wrap,           nullptr, 0, nullptr },
+  { "number",         "nu",   Set::BOOLEAN, Set::GLOBAL, &Set::number,         nullptr, 0, nullptr },
+  { "relativenumber", "rnu",  Set::BOOLEAN, Set::GLOBAL, &Set::relativenumber, nullptr, 0, nullptr },
+  { "autoindent",     "ai",   Set::BOOLEAN, Set::BUFFER, &Set::autoindent,     nullptr, 1, nullptr },
+  { "shiftwidth",     "sw",   Set::NUMBER,  Set::BUFFER, &Set::shiftwidth,     nullptr, 0, nullptr },
+  { "expandtab",      "et",   Set::BOOLEAN, Set::BUFFER, &Set::expandtab,      nullptr, 0, nullptr },
+  { "filetype",       "ft",   Set::TEXT,    Set::BUFFER, nullptr, &Set::filetype,        0, "" },
+};
+static constexpr uint8_t setting_count = sizeof(setting_decls)/sizeof(setting_decls[0]);
+
+// Perfect hash of the names and abbreviations: the seed is searched at
+// compile time so that every key has its own slot.
+static constexpr uint8_t setting_slots = 64;
+static_assert(2*setting_count <= setting_slots/2, "more setting slots needed");
+
+static constexpr uint32_t settingHash(const char* s, size_t len, uint32_t seed)
+{
+  uint32_t h = seed;
+  for(size_t i=0; i<len; i++) h = (h ^ (uint8_t)s[i]) * 16777619u;
+  return (h ^ h >> 16) % setting_slots;
+}
+
+static constexpr size_t cstrlen(const char* s)
+{
+  size_t len = 0;
+  while(s[len]) len++;
+  return len;
+}
+
+struct SettingSlots
+{
+  uint8_t decl[setting_slots] = {};  // index+1 in setting_decls, 0 if free
+  constexpr bool fill(uint32_t seed)
+  {
+    for(uint8_t i=0; i<setting_count; i++)
+      for(const char* key: { setting_decls[i].name, setting_decls[i].abbrev })
+      {
+        uint8_t& slot = decl[settingHash(key, cstrlen(key), seed)];
+        if (slot == i+1) continue;  // abbrev == name
+        if (slot) return false;
+        slot = i+1;
+      }
+    return true;
+  }
+};
+
+static constexpr uint32_t settingSeed()
+{
+  uint32_t seed = 2166136261u;
+  while(not SettingSlots().fill(seed)) seed++;
+  return seed;
+}
+
+static constexpr uint32_t setting_seed = settingSeed();
+
+static constexpr SettingSlots settingSlots()
+{
+  SettingSlots slots;
+  slots.fill(setting_seed);
+  return slots;
+}
+
+static constexpr SettingSlots setting_slots_table = settingSlots();
+
+VimSettings::VimSettings()
+{
+  for(const Decl& decl: setting_decls)
+  {
+    if (decl.text)
+      strncpy(this->*decl.text, decl.def_text, text_size);
+    else
+      this->*decl.number = decl.def;
+  }
+}
+
+const VimSettings::Decl* VimSettings::begin() { return setting_decls; }
+const VimSettings::Decl* VimSettings::end() { return setting_decls+setting_count; }
+
+const VimSettings::Decl* VimSettings::find(const char* name, size_t len)
+{
+  uint8_t slot = setting_slots_table.decl[settingHash(name, len, setting_seed)];
+  if (slot == 0) return nullptr;
+  const Decl& decl = setting_decls[slot-1];
+  for(const char* key: { decl.name, decl.abbrev })
+    if (strncmp(key, name, len) == 0 and key[len] == 0) return &decl;
+  return nullptr;
+}
+
+bool VimSettings::assign(const Decl& decl, const char* value, size_t len)
+{
+  if (decl.type == TEXT)
+  {
+    if (len >= text_size) return false;
+    memcpy(this->*decl.text, value, len);
+    (this->*decl.text)[len] = 0;
+    return true;
+  }
+  uint16_t n = 0;
+  for(size_t i=0; i<len; i++)
+  {
+    if (value[i] < '0' or value[i] > '9') return false;
+    n = n*10 + value[i]-'0';
+    if (n > 255) return false;
+  }
+  if (len == 0) return false;
+  this->*decl.number = n;
+  return true;
+}
+
+size_t VimSettings::print(const Decl& decl, char* out, size_t size) const
+{
+  int len;
+  if (decl.type == BOOLEAN)
+    len = snprintf(out, size, "%s%s", this->*decl.number ? "" : "no", decl.name);
+  else if (decl.type == TEXT)
+    len = snprintf(out, size, "%s=%s", decl.name, this->*decl.text);
+  else
+    len = snprintf(out, size, "%s=%d", decl.name, this->*decl.number);
+  return len < 0 or (size_t)len >= size ? 0 : len;
+}
+
+bool VimSettings::isDefault(const Decl& decl) const
+{
+  if (decl.type == TEXT) return strcmp(this->*decl.text, decl.def_text) == 0;
+  return this->*decl.number == decl.def;
+}
+
 void Vim::redraw()
 {
   term->clear();
@@ -82,27 +409,71 @@ void Vim::redraw()
     if (wbuff)
     {
       wbuff->draw(win, *term);
-      if (wid==curwid) wbuff->focus(*term);
+      wbuff->status(win, *term);
+    }
+    return true;
+  });
+  render();
+}
+
+void Vim::render()
+{
+  if (quitting) return;
+  Window all(1, 1, term->sx, term->sy);
+  Window focus_win;
+  WindowBuffer* focused = nullptr;
+  splitter.forEachWindow(all, [this, &focus_win, &focused](const Window& win, Wid wid, const Splitter*)
+  {
+    WindowBuffer* wbuff = getWBuff(wid);
+    if (wbuff)
+    {
+      if (wid == curwid)
+      {
+        focused = wbuff;
+        focus_win = win;
+      }
+      else if (wbuff->paint(win, *term))
+        wbuff->status(win, *term);
     }
     return true;
   });
+  if (focused)
+  {
+    focused->paint(focus_win, *term);
+    if (settings.mode != COMMAND) focused->focus(focus_win, *term);
+  }
+  term->flush();  // the frame goes out in full packets
+  if (link) link->flush();
+}
+
+void Vim::quit()
+{
+  quitting = true;
+  for(auto& it: buffers)
+    if (it.second.use_count() == 1) it.second->closeJournal();
+  terminate();
 }
 
-Vim::Vim(TinyTerm* term, const tiny_bash::TinyEnv& e, string args)
+std::map<string, std::weak_ptr<Buffer>> Vim::shared_buffers;
+uint16_t Vim::sessions = 0;
+
+Vim::Vim(TinyTerm* term, const tiny_bash::TinyEnv& e, string args, Transport* link)
   : TinyApp(term,e)
-  , splitter('h', term->sy-3), term(term)
+  , session(sessions++), splitter('h', term->sy-3), term(term), link(link)
 {
-  Wid unused_side_0;
+  Wid side_0;
 
   if (term==nullptr or not term->isTerm() or term->sx==0 or term->sy==0)
   {
-    terminate();
+    quit();
     return;
   }
+  if (link) link->begin();
   // TODO Should be done periodically
   term->saveCursor();
   term->getTermSize();
   term->restoreCursor();
+  if (link) *term << "\033[?2004h";  // bracketed paste, decoded by receive()
 
   char orientation = 'v';
   bool first_split = true;
@@ -110,14 +481,26 @@ Vim::Vim(TinyTerm* term, const tiny_bash::TinyEnv& e, string args)
   auto rows=term->sy-3;
   auto cols=term->sx;
   WindowBuffer* last_wbuff = nullptr;
+  bool recovering = false;
+  Buffer::Mode mode = Buffer::EDIT;
   curwid=0xC000;
+  loadRc();  // before the buffers, they start with these settings
   while(args.length())
   {
     std::string arg=getWord(args);
     if (arg[0]=='+')
     {
-      if (last_wbuff) last_wbuff->gotoxy(getInt(arg));
+      if (last_wbuff)
+      {
+        Cursor::type row = getInt(arg);
+        loadTo(last_wbuff->buffer(), row+term->sy);
+        last_wbuff->gotoxy(row);
+      }
     }
+    else if (arg=="-r")
+      recovering = true;
+    else if (arg=="-R")
+      mode = Buffer::VIEW;
     else
     {
       std::string file(getFile(env.cwd, arg));
@@ -133,32 +516,313 @@ Vim::Vim(TinyTerm* term, const tiny_bash::TinyEnv& e, string args)
             rows /= 2;
           else
             cols /= 2;
-          auto size = (orientation ? rows : cols);
+          auto size = (orientation=='h' ? rows : cols);
           splitter.split(curwid, orientation, size);
 
           orientation = orientation == 'h' ? 'v' : 'h';
-          Window::calcSplitWids(curwid, unused_side_0, curwid);
+          // The previous file moves to side_0, the new one is side_1
+          Wid split_wid = curwid;
+          Window::calcSplitWids(split_wid, side_0, curwid);
+          for(auto& it: buffers) it.second->moveWindow(viewId(split_wid), viewId(side_0));
+        }
+        bool shared;
+        Buffer& buff = openBuffer(file, shared);
+        if (not shared)
+        {
+          buff.local = settings;
+          buff.setFileName(file.c_str());
+          load(buff, file, recovering, mode);
         }
-        buffers[file].read(file.c_str());
-        buffers[file].setFileName(file.c_str());
-        last_wbuff = buffers[file].addWindow(curwid);
+        last_wbuff = buff.addWindow(viewId(curwid));
      //   buffers[file].redraw(curwid, term, &splitter);
       }
     }
   }
-  buffers[":"].addWindow(0x4000);
+  Buffer& cmdline = *(buffers[":"] = std::make_shared<Buffer>());
+  cmdline.local = settings;
+  cmdline.applySettings();
+  cmdline.addWindow(viewId(0x4000));
   redraw();
 }
 
+Vim::~Vim()
+{
+  // The windows of this session leave the shared buffers
+  if (term)
+  {
+    Window all(1, 1, term->sx, term->sy);
+    splitter.forEachWindow(all, [this](const Window&, Wid wid, const Splitter*)
+    {
+      for(auto& it: buffers) it.second->removeWindow(viewId(wid));
+      return true;
+    });
+    if (link)
+    {
+      *term << "\033[?2004l";
+      link->flush();
+    }
+  }
+  // A job may work on a buffer shared with another session
+  for(Job& job: jobs)
+    if (job.end) job.end(true);
+  jobs.clear();
+  buffers.clear();
+  for(auto it = shared_buffers.begin(); it != shared_buffers.end();)
+  {
+    if (it->second.expired()) it = shared_buffers.erase(it);
+    else ++it;
+  }
+}
+
+Buffer& Vim::openBuffer(const string& name, bool& shared)
+{
+  std::weak_ptr<Buffer>& registered = shared_buffers[name];
+  std::shared_ptr<Buffer>& buff = buffers[name];
+  buff = registered.lock();
+  shared = (bool)buff;
+  if (not shared) registered = buff = std::make_shared<Buffer>();
+  return *buff;
+}
+
 void Vim::drawSplitter()
 {
   Window split_win(1,1,term->sx, term->sy);
   splitter.draw(split_win, *term);
 }
 
+void Vim::load(Buffer& buff, const string& file, bool recovering, Buffer::Mode mode)
+{
+  if (not buff.load(file.c_str(), mode))
+  {
+    buff.openJournal(recovering);
+    return;
+  }
+  // The first screen is read now, the remaining lines by the job
+  loadTo(buff, term->sy);
+  addJob({ "Loading " + file,
+    [&buff](Job& job, uint32_t deadline) { return buff.ioSlice(deadline, job.progress); },
+    [this, &buff, recovering](bool cancelled)
+    {
+      if (cancelled)
+        buff.ioCancel();
+      else
+        buff.openJournal(recovering);
+      validateCursors();  // +line
+    }});
+}
+
+// The hex view of a file is the buffer "file [hex]"
+bool Vim::view(const string& file, Buffer::Mode mode)
+{
+  WindowBuffer* wbuff = getWBuff(curwid);
+  if (wbuff == nullptr or isCommandLine(wbuff->buffer())) return false;
+  string name = mode == Buffer::HEX ? file + " [hex]" : file;
+  auto it = buffers.find(name);
+  if (it != buffers.end())
+  {
+    if (mode == Buffer::VIEW)
+    {
+      error("Already open");
+      return false;
+    }
+    showBuffer(*it->second);
+    return true;
+  }
+  if (not FILE_SYSTEM.exists(file.c_str()))
+  {
+    error("Unable to open file");
+    return false;
+  }
+  bool shared;
+  Buffer& buff = openBuffer(name, shared);
+  if (not shared)
+  {
+    buff.local = settings;
+    buff.setFileName(file.c_str());
+    load(buff, file, false, mode);
+  }
+  showBuffer(buff);
+  return true;
+}
+
+void Vim::showBuffer(Buffer& buff)
+{
+  WindowBuffer* wbuff = getWBuff(curwid);
+  if (wbuff) wbuff->buffer().removeWindow(viewId(curwid));
+  buff.addWindow(viewId(curwid));
+  validateCursors();
+  redraw();
+}
+
+void Vim::loadTo(Buffer& buff, Cursor::type row)
+{
+  uint8_t progress;
+  while(buff.loading() and buff.lines() < row)
+    buff.ioSlice(std::numeric_limits<uint32_t>::max(), progress, row);
+}
+
+bool Vim::save(Buffer& buff, const string& file, bool force, bool quit_after)
+{
+  if (not buff.save(file, force)) return false;
+  addJob({ "Saving",
+    [&buff](Job& job, uint32_t deadline) { return buff.ioSlice(deadline, job.progress); },
+    [this, &buff, quit_after](bool cancelled)
+    {
+      if (cancelled)
+        buff.ioCancel();
+      else if (quit_after)
+        quit();
+    }});
+  return true;
+}
+
+void Vim::checkpoint(Buffer& buff)
+{
+  if (not buff.startCheckpoint()) return;
+  addJob({ "Writing swap",
+    [&buff](Job& job, uint32_t deadline) { return buff.checkpoint(deadline, job.progress); },
+    [&buff](bool cancelled) { if (cancelled) buff.checkpointCancel(); }});
+}
+
+void Vim::search(const string& pattern)
+{
+  WindowBuffer* wbuff = getWBuff(curwid);
+  if (wbuff == nullptr or pattern.empty()) return;
+  search_ = pattern;
+  Buffer& buff = wbuff->buffer();
+  Cursor start = wbuff->buffCursor();
+  Cursor::type row = start.row;
+  Cursor::type scanned = 0;
+  Wid wid = curwid;
+  // Lines after the cursor, then from the top (the cursor line is scanned twice)
+  addJob({ "Searching " + pattern,
+    [this, &buff, pattern, start, row, scanned, wid](Job& job, uint32_t deadline) mutable
+    {
+      Cursor::type lines = buff.lines();
+      while(scanned <= lines)
+      {
+        size_t found = buff.getLine(row).find(pattern, scanned ? 0 : start.col);
+        if (found != string::npos)
+        {
+          Window win;
+          WindowBuffer* wbuff = getWBuff(wid);
+          if (wbuff and calcWindow(wid, win))
+            wbuff->jumpTo(Cursor(row, found+1), win, *this);
+          return false;
+        }
+        row = row < lines ? row+1 : 1;
+        scanned++;
+        buff.releaseBlocks();
+        if (millis() >= deadline) break;
+      }
+      job.progress = (uint32_t)scanned*100/(lines+1);
+      if (scanned <= lines) return true;
+      error("Pattern not found");
+      return false;
+    }, nullptr });
+}
+
+void Vim::cancelJobs()
+{
+  std::list<Job> cancelled;
+  cancelled.swap(jobs);
+  for(Job& job: cancelled)
+    if (job.end) job.end(true);
+  message("Cancelled");
+}
+
+void Vim::message(const string& msg, bool is_error)
+{
+  Window win;
+  if (settings.mode == COMMAND or not calcWindow(0x4000, win)) return;
+  string s = msg.substr(0, win.width);
+  *term << TinyTerm::hide_cur << TinyTerm::save_cursor;
+  term->gotoxy(win.top, win.left);
+  if (is_error) *term << TinyTerm::red;
+  *term << s;
+  if (is_error) *term << TinyTerm::white;
+  *term << string(win.width-s.length(), ' ');
+  *term << TinyTerm::restore_cursor << TinyTerm::show_cur;
+}
+
 void Vim::loop()
 {
+  if (link)
+  {
+    link->poll();
+    receive();
+  }
+  for(auto& it: buffers) it.second->releaseBlocks();
+  if (paste.length() and not pasting and millis()-last_key >= paste_gap)
+  {
+    suspendRender();
+    endPaste();
+    resumeRender();
+  }
+  if (jobs.size() and not suspended)
+  {
+    Job& job = jobs.front();
+    uint8_t progress = job.progress;
+    if (job.step(job, millis()+job_slice))
+    {
+      if (job.progress != progress)
+      {
+        message(job.name + ' ' + std::to_string(job.progress) + '%');
+        render();
+      }
+    }
+    else
+    {
+      auto end = std::move(job.end);
+      jobs.pop_front();
+      message("");
+      if (end) end(false);
+      render();
+    }
+  }
+  bool idle = millis()-last_key > journal_delay;
+  for(auto& it: buffers) it.second->journal(idle);
+  if (idle)
+    for(auto& it: buffers)
+      if (it.second->checkpointDue()) checkpoint(*it.second);
+  if (idle) for(auto& it: buffers) it.second->pack(millis()+job_slice);
+
+  bool poll = millis()-last_poll >= follow_poll;
+  if (poll) last_poll = millis();
+  for(auto& it: buffers)
+  {
+    Buffer& buff = *it.second;
+    if (not buff.following() or not (poll or buff.busy())) continue;
+    Cursor::type last = buff.lines();
+    if (not buff.poll(millis()+job_slice)) continue;
+    // Cursors on the last line follow the new lines
+    Window all(1, 1, term->sx, term->sy);
+    splitter.forEachWindow(all, [this, &buff, last](const Window& win, Wid wid, const Splitter*)
+    {
+      WindowBuffer* wbuff = buff.getWBuff(viewId(wid));
+      if (wbuff == nullptr) return true;
+      if (wbuff->buffCursor().row >= last) wbuff->gotoxy(buff.lines(), 1);
+      wbuff->validateCursor(win, *this);
+      return true;
+    });
+    render();
+  }
 
+  // Changes of a shared buffer by another session
+  bool shared = false;
+  for(auto& it: buffers) shared = shared or it.second.use_count() > 1;
+  if (not shared or suspended) return;
+  bool stale = false;
+  Window all(1, 1, term->sx, term->sy);
+  splitter.forEachWindow(all, [this, &stale](const Window& win, Wid wid, const Splitter*)
+  {
+    WindowBuffer* wbuff = getWBuff(wid);
+    if (wbuff == nullptr or not wbuff->stale()) return true;
+    wbuff->validateCursor(win, *this);
+    stale = true;
+    return true;
+  });
+  if (stale) render();
 }
 
 void Window::frame(TinyTerm& term)
@@ -212,30 +876,56 @@ void Window::frame(TinyTerm& term)
 void Buffer::reset()
 {
   buffer.clear();
-  cr1=cr2=0;
+  view_ = hex_ = false;
+  view_index.clear();
+  view_lines = view_done = 0;
+  view_file.close();
+  for(auto& block: view_blocks) block.lines.clear();
+  following_ = false;
+  follow_ring.clear();
+  resetSyntax();
+  eol_ = EOL_NONE;
+  eol_last = true;
+  eols.clear();
   modified_=false;
   filename_.clear();
+  marks.clear();
+  mark_rows.clear();
+  jumps.clear();
+  jump_pos = 0;
+  bracket_depths.clear();
+  packed.clear();
+  pack_loaded.clear();
+  pack_next = 1;
 }
 
-void WindowBuffer::gotoxy(uint16_t row, uint16_t col)
+void WindowBuffer::gotoxy(Cursor::type row, Cursor::col_type col)
 {
   cursor.row=row;
   cursor.col=col;
 }
 
-WindowBuffer* Buffer::addWindow(Wid wid)
+WindowBuffer* Buffer::addWindow(ViewId view)
 {
-  if (getWBuff(wid)==nullptr)
+  if (getWBuff(view)==nullptr)
   {
-    wbuffs.emplace(wid, std::unique_ptr<WindowBuffer>(new WindowBuffer(*this)));
-    return wbuffs[wid].get();
+    wbuffs.emplace(view, std::unique_ptr<WindowBuffer>(new WindowBuffer(*this)));
+    return wbuffs[view].get();
   }
   return nullptr;
 }
 
-WindowBuffer* Buffer::getWBuff(Wid wid)
+void Buffer::moveWindow(ViewId from, ViewId to)
 {
-  auto it=wbuffs.find(wid);
+  auto it=wbuffs.find(from);
+  if (it == wbuffs.end()) return;
+  wbuffs[to] = std::move(it->second);
+  wbuffs.erase(from);
+}
+
+WindowBuffer* Buffer::getWBuff(ViewId view)
+{
+  auto it=wbuffs.find(view);
   if (it == wbuffs.end()) return nullptr;
 
   return it->second.get();
@@ -243,695 +933,3897 @@ WindowBuffer* Buffer::getWBuff(Wid wid)
 
 Cursor::type Buffer::lines() const
 {
-  if (buffer.size() == 0) return 0;
-  return buffer.rend()->first;
+  return view_ ? view_lines : buffer.size();
 }
 
-std::string Buffer::deleteLine(Cursor::type line)
+void Buffer::touch(Cursor::type first, Cursor::type last)
 {
-  Cursor::type last=lines();
-  if (line>last) return "";
-  std::string s=buffer[line];
-  while(line<last)
+  version_++;
+  pack_done = false;
+  for(auto& index: column_index)
+    if (index.row >= first and index.row <= last) index.row = 0;
+  if (dirty_log.size())
   {
-    buffer[line]=buffer[line+1];
-    line++;
+    DirtyRange& back = dirty_log.back();
+    if (first <= back.last+1 and last+1 >= back.first)
+    {
+      back.first = std::min(first, back.first);
+      back.last = std::max(last, back.last);
+      back.version = version_;
+      return;
+    }
   }
-  buffer.erase(line);
-  return s;
+  if (dirty_log.size() == max_dirty_log)
+  {
+    forgotten_ = dirty_log.front().version;
+    dirty_log.pop_front();
+  }
+  dirty_log.push_back({version_, first, last});
 }
 
-void Buffer::insertLine(Cursor::type line)
+bool Buffer::changes(uint32_t since, std::function<void(Cursor::type, Cursor::type)> fun) const
 {
-  Cursor::type last=lines();
-  std::string s=getLine(line);
-  takeLine(line).clear();
-  while(line<=last)
-    std::swap(takeLine(++line), s);
+  if (since < forgotten_) return false;
+  for(const auto& range: dirty_log)
+    if (range.version > since) fun(range.first, range.last);
+  return true;
 }
 
-string& Buffer::takeLine(Cursor::type line)
+/*
+  Syntax highlighting: each Syntax is a lexer description, lexLine()
+  colors a line from the state left by the previous line. Only strings
+  can span lines so the state is the opening quote (or 0).
+*/
+struct Syntax
 {
-  modified_ = true;
-  return buffer[line];
-}
+  const char* extensions; // comma separated
+  const char* comments;   // chars starting a comment up to eol
+  const char* quotes;     // string delimiters
+  bool multiline;         // strings may span lines
+  const char* keysep;     // a word or string followed by one of these is a key
+  bool sections;          // [section] lines
+  char variable;          // prefix of variables ($)
+  const char* keywords;   // comma separated
+};
 
-const string& Buffer::getLine(Cursor::type line) const
-{
-  static string empty;
-  auto it=buffer.find(line);
-  if (it != buffer.end()) return it->second;
-  return empty;
-}
+enum Token : uint8_t { TOK_NORMAL, TOK_COMMENT, TOK_STRING, TOK_NUMBER, TOK_KEY, TOK_KEYWORD, TOK_SECTION };
 
-void Buffer::redraw(Wid wid, TinyTerm* term, Splitter* splitter)
+static constexpr const char* token_colors[] = {
+  "\033[39m", "\033[34m", "\033[32m", "\033[35m", "\033[33m", "\033[36m", "\033[31m"
+};
+static constexpr const char* gutter_color = "\033[33m";
+
+static const Syntax syntaxes[] = {
+  { "json", "", "\"", false, ":", false, 0, "true,false,null" },
+  { "ini,cfg,conf,properties", ";#", "\"", false, "=:", true, 0, "true,false,on,off,yes,no" },
+  { "yaml,yml", "#", "\"'", false, ":", false, 0, "true,false,null,yes,no,on,off" },
+  { "sh,bash", "#", "\"'", true, "=", false, '$',
+    "if,then,else,elif,fi,for,while,until,do,done,case,esac,in,function,return,local,export,exit" }
+};
+
+// Token start positions of a line, (col, Token)
+using Spans = std::vector<std::pair<uint16_t, uint8_t>>;
+
+static uint8_t lexLine(const Syntax& syn, const string& s, uint8_t state, Spans* spans)
 {
-  Window win(1,1,term->sx, term->sy);
-  if (splitter->calcWindow(wid, win))
+  auto emit = [spans](size_t col, uint8_t token)
   {
-    auto wit=wbuffs.find(wid);
-    if (wit!=wbuffs.end())
-    {
-      wit->second->draw(win, *term);
-      wit->second->focus(*term);
-    }
-  }
-  else
-    error("Buffer::redraw");
-}
+    if (spans == nullptr) return;
+    if (spans->size() and spans->back().second == token) return;
+    spans->push_back({(uint16_t)col, token});
+  };
+  auto isWord = [](char c) { return isalnum(c) or c=='_' or c=='-' or c=='.'; };
+  // returns true if next non space char is a key separator
+  auto isKey = [&syn, &s](size_t i)
+  {
+    while(i < s.length() and s[i]==' ') i++;
+    return i < s.length() and s[i] and strchr(syn.keysep, s[i]);
+  };
+  auto endOfString = [&s](size_t i, char quote) -> size_t
+  {
+    while(i < s.length() and s[i]!=quote)
+      i += (s[i]=='\\' and quote!='\'') ? 2 : 1;
+    return i;
+  };
 
-bool Buffer::read(const char* filename)
-{
-  uint16_t lines = 1;
-  File file = FILE_SYSTEM.open(filename, "r");
-  if (!file)
+  size_t i = 0;
+  bool first_token = true;
+  if (state)
   {
-    error("Unable to open file");
-    return false;
+    emit(0, TOK_STRING);
+    i = endOfString(0, state);
+    if (i >= s.length()) return state;
+    state = 0;
+    emit(++i, TOK_NORMAL);
   }
-  string s;
-  while (file.available())
+  while(i < s.length())
   {
-    auto c = file.read();
-    if (c==13 or c==10)
+    char c = s[i];
+    size_t start = i;
+    if (c==' ' or c=='\t') { i++; continue; }
+    if (c and strchr(syn.comments, c) and (i==0 or s[i-1]==' ' or s[i-1]=='\t' or syn.variable==0))
     {
-      if (cr1==0) cr1=c;
-      if (c==cr1)
-        buffer[lines++] = s;
-      else if (cr2==0)
-        cr2=c;
-      else if (c!=cr2)
-        error("bad eol");
-      s.clear();
+      emit(i, TOK_COMMENT);
+      return 0;
     }
-    else
-      s += (char)c;
-    if (lines==0)
+    if (syn.sections and first_token and c=='[')
     {
-      error("Document too long (don't save it)");
+      emit(i, TOK_SECTION);
+      emit(s.length(), TOK_NORMAL);
+      return 0;
     }
- }
-  if (s.length()) buffer[lines++] = s; // (no eol)
-  return true;
-}
-
-bool Buffer::save(std::string filename, bool force)
-{
-  if (filename.length()==0) { filename = filename_; force=true; }
-  if (filename.length())
-  {
-    if (cr1==0) { cr1=13; cr2=10; }
-    Term << "TRYING " << filename << ", f=" << force << endl;
-    if (force or not FILE_SYSTEM.exists(filename.c_str()))
+    if (c and strchr(syn.quotes, c))
     {
-      File file=FILE_SYSTEM.open(filename.c_str(), "w");
-      if (not file) return false;
-      Term << "WRITING " << (file ? 1 : 0) << ' ' << lines() << " lines" << endl;
-      for(Cursor::type l=1; l<=lines(); l++)
+      i = endOfString(i+1, c);
+      if (i >= s.length() and syn.multiline)
       {
-        Term.clear();
-        Term << "WRITE " << (int)l << ' ' << getLine(l) << '.' << endl;
-        file << getLine(l).c_str() << cr1;
-        if (cr2) file << cr2;
+        emit(start, TOK_STRING);
+        return c;
       }
-      modified_ = false;
-      return true;
+      i++;
+      emit(start, isKey(i) ? TOK_KEY : TOK_STRING);
+    }
+    else if (syn.variable and c==syn.variable)
+    {
+      i++;
+      while(i < s.length() and (isalnum(s[i]) or s[i]=='_' or s[i]=='{' or s[i]=='}')) i++;
+      emit(start, TOK_KEY);
+    }
+    else if (isdigit(c) or (c=='-' and i+1 < s.length() and isdigit(s[i+1])))
+    {
+      i++;
+      while(i < s.length() and isWord(s[i])) i++;
+      emit(start, TOK_NUMBER);
+    }
+    else if (isWord(c))
+    {
+      while(i < s.length() and isWord(s[i])) i++;
+      string word = s.substr(start, i-start);
+      if (first_token and isKey(i))
+        emit(start, TOK_KEY);
+      else
+        emit(start, getIndex(syn.keywords, word.c_str())>=0 ? TOK_KEYWORD : TOK_NORMAL);
     }
     else
-      error("File exists");
+    {
+      i++;
+      emit(start, TOK_NORMAL);
+    }
+    if (i > start) emit(i, TOK_NORMAL);
+    first_token = false;
   }
-  return false;
+  return 0;
 }
 
-bool WindowBuffer::save(const std::string& filename, bool force)
+void Buffer::setFileName(const std::string& filename)
 {
-  return buff.save(filename, force);
+  filename_ = filename;
+  size_t dot = filename.rfind('.');
+  if (dot != std::string::npos and local.filetype[0] == 0)
+  {
+    string ext = filename.substr(dot+1);
+    for(const Syntax& syn: syntaxes)
+      if (getIndex(syn.extensions, ext.c_str()) >= 0)
+        local.assign(*VimSettings::find("ft", 2), ext.c_str(), ext.length());
+  }
+  applySettings();
 }
 
-void Vim::error(const char* err)
+void Buffer::resetSyntax()
 {
-  tiny_vim::error(err); // FIXME
+  eol_states.clear();
+  lex_first = 1;
+  lexed = 0;
+  stale_first = 1;
 }
 
-WindowBuffer* Vim::getWBuff(Wid wid)
+void Buffer::syntaxChanged(Cursor::type row)
 {
-  for(auto &buff: buffers)
-  {
-    WindowBuffer* wbuff = buff.second.getWBuff(wid);
-    if (wbuff) return wbuff;
-  }
-  return nullptr;
+  if (row > lexed or row < lex_first) return;
+  if (stale_first > lexed) stale_first = stale_last = row;
+  else if (row < stale_first) stale_first = row;
+  else if (row > stale_last) stale_last = row;
 }
 
-void Vim::setMode(uint8_t mode)
+uint8_t Buffer::syntaxState(Cursor::type row)
 {
-  if (settings.mode != mode)
+  // Only the strings of a multiline syntax continue on the next line
+  if (syntax_ == nullptr or not syntax_->multiline) return 0;
+  Cursor::type need = std::min(row-1, (int)lines());
+  if (need < 1) return 0;
+  if (need < lex_first or need > lexed+syntax_sync)
   {
-    settings.mode = mode;
+    resetSyntax();
+    lex_first = std::max(need-syntax_sync, 1);
+    lexed = stale_first = lex_first-1;
+  }
 
-    // TODO draw status in status bar
-    vdebug("mode",mode);
-    // TODO draw status
+  // Lex stale lines again until the end state is the one cached
+  while(stale_first <= need and stale_first <= lexed)
+  {
+    Cursor::type line = stale_first++;
+    uint8_t state = lexLine(*syntax_, getLine(line), stateBefore(line), nullptr);
+    bool same = eolState(line) == state;
+    eolState(line) = state;
+    if (not same and stale_last <= line) stale_last = line+1;
+    if (same and line >= stale_last) stale_first = lexed+1;
+  }
+  while(lexed < need)
+  {
+    lexed++;
+    eol_states.push_back(lexLine(*syntax_, getLine(lexed), stateBefore(lexed), nullptr));
+    if (stale_first == lexed) stale_first++;
   }
+  if (lexed-lex_first >= syntax_cache and need-lex_first >= syntax_cache/2)
+  {
+    eol_states.erase(eol_states.begin(), eol_states.begin()+syntax_cache/2);
+    lex_first += syntax_cache/2;
+    stale_first = std::max(stale_first, lex_first);
+  }
+  return eolState(need);
 }
 
-bool Vim::calcWindow(Wid wid, Window& win)
+const Buffer::ColumnIndex& Buffer::columnIndex(Cursor::type row) const
 {
-  win=Window(1,1, term->sx, term->sy);
-  return splitter.calcWindow(wid, win);
-}
+  for(const auto& index: column_index)
+    if (index.row == row) return index;
 
-void Vim::play(const Record& rec, uint8_t count)
-{
-  playing = true;
-  while(count)
+  ColumnIndex& index = column_index[column_next];
+  column_next = (column_next+1) % (sizeof(column_index)/sizeof(column_index[0]));
+  const string& s = getLine(row);
+  index.row = row;
+  index.ascii = true;
+  index.cols.clear();
+  uint16_t col = 0;
+  for(size_t i=0; i<s.length(); i++)
   {
-    count--;
-    for(auto key: rec) onKey(key);
+    if (i % column_step == 0) index.cols.push_back(col);
+    if ((s[i] & 0x80) or isControl(s[i])) index.ascii = false;
+    col += charWidth(s[i], col, tabstop_);
   }
-  playing = false;
-}
-
-void Vim::clip(const std::string& buff)
-{
-  clipboard_ = buff; 
+  if (index.ascii) index.cols.clear();
+  return index;
 }
 
-char getChar(std::string& cmd)
+uint16_t Buffer::displayCol(Cursor::type row, size_t byte) const
 {
-  if (cmd.length()==0) return 0;
-  char c=cmd[0];
-  cmd.erase(0,1);
-  return c;
+  const ColumnIndex& index = columnIndex(row);
+  if (index.ascii) return byte;
+  const string& s = getLine(row);
+  size_t k = std::min(byte / column_step, index.cols.size()-1);
+  uint16_t col = index.cols[k];
+  for(size_t i=k*column_step; i<byte; i++)
+  {
+    if (i >= s.length()) col++;
+    else col += charWidth(s[i], col, tabstop_);
+  }
+  return col;
 }
 
-bool Vim::onCommand(std::string cmd)
+size_t Buffer::byteAt(Cursor::type row, uint16_t col) const
 {
-  bool ret=true;
-  vdebug("EXEC", cmd << "   ");
-  WindowBuffer *wbuff = getWBuff(curwid);
-  while(cmd.length())
+  const ColumnIndex& index = columnIndex(row);
+  if (index.ascii) return col;
+  const string& s = getLine(row);
+  auto it = std::upper_bound(index.cols.begin(), index.cols.end(), col);
+  size_t k = it - index.cols.begin() - 1;
+  size_t i = k*column_step;
+  uint16_t cur = index.cols[k];
+  while(i < s.length() and isUtf8Cont(s[i])) i++;
+  while(i < s.length())
   {
-    char c=getChar(cmd);
-    bool force=cmd[0]=='!';
-    bool ok=false;
-    Term << "EVAL CMD " << (c ? (char)c : '?') << endl;
-    switch (c)
-    {
-      case 'w':
-        if (wbuff and wbuff->save(getFile(env.cwd, cmd), force))
-          ok = true;
-        break;
-      case 'x':
-        if (wbuff and wbuff->save(getFile(env.cwd, cmd), force)) terminate();
-        break;
-      case 'q':
-        terminate();
-        return true;
-    }
-    Term << "RAN " << c << " res=" << ok << endl;
-    ret &= ok;
-    if (not ok)
-      error("Error in command");
+    uint16_t width = charWidth(s[i], cur, tabstop_);
+    if (col < cur+width) return i;
+    cur += width;
+    i = nextChar(s, i);
   }
-  vdebug("EXEC", "end exec, ret=" << ret);
-  return ret;
+  return s.length() + (col-cur);
 }
 
-void Vim::onKey(TinyTerm::KeyCode key)
+void Buffer::applySettings()
 {
-  Action cmd = Action::VIM_UNKNOWN;
-  vdebug("vimkey", "key:" << (key>31 and key<128 ? (char)key : ' ') << " (" << (int)key << "), recsize " << record.size() << ", rpt_count=" << rpt_count << ", play=" << playing << ", mode=" << settings.mode << "  ");
-
-  if (key == TinyTerm::KEY_ESC)
-  {
-    record.clear(); // FIXME
-    setMode(NORMAL);
-    return;
-  }
-  else if (key==TinyTerm::KEY_LEFT) cmd=Action::VIM_MOVE_LEFT;
-  else if (key==TinyTerm::KEY_RIGHT) cmd=Action::VIM_MOVE_RIGHT;
-  else if (key==TinyTerm::KEY_UP) cmd=Action::VIM_MOVE_UP;
-  else if (key==TinyTerm::KEY_DOWN) cmd=Action::VIM_MOVE_DOWN;
-  else if (key==TinyTerm::KEY_CTRL_C)
+  uint8_t ts = local.ts ? local.ts : 1;
+  if (ts != tabstop_)
   {
-    terminate();
-    return;
+    tabstop_ = ts;
+    for(auto& index: column_index) index.row = 0;
+    touch(1, std::numeric_limits<Cursor::type>::max());
   }
-  if (not playing)
+  const Syntax* syntax = nullptr;
+  if (local.filetype[0] and not view_)  // a view does not lex the whole file
+    for(const Syntax& syn: syntaxes)
+      if (getIndex(syn.extensions, local.filetype) >= 0) syntax = &syn;
+  if (syntax != syntax_)
   {
-    if (settings.mode != NORMAL or key<'0' or key>'9')
-      record.push_back(key);
+    syntax_ = syntax;
+    resetSyntax();
+    touch(1, std::numeric_limits<Cursor::type>::max());
   }
+}
 
-  Wid wid=settings.mode==COMMAND ? 0x4000 : curwid;
-  WindowBuffer *wbuff = getWBuff(wid);
-  Window win;
-  if (!calcWindow(wid, win))
+uint16_t Buffer::indentWidth(std::string_view line) const
+{
+  uint16_t width = 0;
+  for(char c: line)
   {
-    vdebug("vcalc_win", "bad " << hex(wid));
-    wbuff=nullptr;
+    if (c == '\t') width += tabstop_ - width % tabstop_;
+    else if (c == ' ') width++;
+    else break;
   }
-  else
-    vdebug("vcalc_win", hex(wid) << ", " << win);
+  return width;
+}
 
-  if (key == TinyTerm::KEY_CTRL_L)
+string Buffer::indentOf(uint16_t width) const
+{
+  if (local.expandtab) return string(width, ' ');
+  return string(width/tabstop_, '\t') + string(width%tabstop_, ' ');
+}
+
+// Brackets of a line outside of strings and // comments: closes before
+// the text (leading) and opens minus closes after them (delta)
+static void lineBrackets(std::string_view line, int16_t& leading, int16_t& delta)
+{
+  leading = delta = 0;
+  bool text = false;
+  char quote = 0;
+  for(size_t i=0; i<line.length(); i++)
   {
-    redraw();
-    return;
+    char c = line[i];
+    if (quote)
+    {
+      if (c == '\\') i++;
+      else if (c == quote) quote = 0;
+      continue;
+    }
+    if (c == '"' or c == '\'') quote = c;
+    else if (c == '/' and i+1 < line.length() and line[i+1] == '/') break;
+    else if (c and strchr("{([", c)) delta++;
+    else if (c and strchr("})]", c))
+    {
+      if (text) delta--;
+      else leading++;
+      continue;
+    }
+    if (c != ' ' and c != '\t') text = true;
   }
+}
 
-  if (key == ':' and settings.mode == NORMAL)
+void Buffer::indentLines(Cursor::type first, Cursor::type last, char op)
+{
+  int32_t sw = shiftWidth();
+  int16_t leading, delta;
+  int32_t level = 0;  // '=': indent of the next line
+  if (op == '=')
   {
-    settings.mode = COMMAND;
-    scmd.clear();
-    return;
+    Cursor::type above = first-1;
+    while(above >= 1 and getLine(above).find_first_not_of(" \t") == string::npos) above--;
+    if (above >= 1)
+    {
+      const string& line = getLine(above);
+      lineBrackets(line, leading, delta);
+      level = indentWidth(line) + (delta > 0 ? sw : 0);
+    }
   }
-  else if (settings.mode == COMMAND)
+  for(Cursor::type row=first; row<=last and row<=lines(); row++)
   {
-    // NOTE: mode command could be handled by a TinyConsole instance initialized with a virtual TinyTerm:
-    // a term delimited by 0x4000 window.
-    // TODO, WindowBuffer is nearly what is expected, especially clipping region.
-    // WindowBuffer class should be splitted in VirtualTerm handling the window region.
-    switch(key)
+    const string& line = getLine(row);
+    size_t text = line.find_first_not_of(" \t");
+    int32_t width;
+    if (op == '=')
     {
-      case TinyTerm::KEY_RETURN:
+      if (text == string::npos)
       {
-        settings.mode = NORMAL;
-        vdebug("COMMAND", "EXEC " << scmd);
-        onCommand(scmd);
-        scmd.clear();
-        break;
+        if (line.length()) takeLine(row).clear();
+        continue;
       }
-      case TinyTerm::KEY_BACK:
-        if (scmd.length()) scmd.erase(scmd.length()-1,1);
-        break;
-      default:
-        if (key>=' ' and key<=128)
-          scmd += key;
-        vdebug("COMMAND", scmd << "   ");
-        break;
+      lineBrackets(line, leading, delta);
+      width = std::max<int32_t>(level - leading*sw, 0);
+      level = std::max<int32_t>(width + delta*sw, 0);
     }
-    term->gotoxy(win.top, win.left);
-    *term << scmd << "   ";
-    term->gotoxy(win.top, win.left+scmd.length());
-    return;
+    else
+    {
+      if (line.empty()) continue;
+      width = std::max<int32_t>(indentWidth(line) + (op == '>' ? sw : -sw), 0);
+    }
+    if (text == string::npos) text = line.length();
+    string indent = indentOf(width);
+    if (line.compare(0, text, indent) != 0) takeLine(row).replace(0, text, indent);
+    releaseBlocks();
   }
-  
-  if (settings.mode == NORMAL or cmd!=Action::VIM_UNKNOWN)
+}
+
+// LZF format: a control byte c < 32 is followed by c+1 literal bytes, else
+// it copies (c>>5)+2 bytes (7: plus the next byte) from ((c&31)<<8 | next)+1
+// bytes back. The table keeps the position+1 of 3 bytes modulo 65536:
+// an older position gives wrong bytes, rejected by the memcmp.
+void Buffer::lzfPack(const string& in, std::vector<uint8_t>& out, uint16_t* table)
+{
+  std::fill(table, table+lzf_table, 0);
+  const uint8_t* s = (const uint8_t*)in.data();
+  size_t n = in.length();
+  size_t lit = 0;    // control byte of the literals
+  uint8_t lits = 0;  // 0: none
+  out.clear();
+  for(size_t i=0; i<n;)
   {
-    if (key>='0' and key<='9' and not playing)
+    size_t ref = 0;
+    if (i+2 < n)
     {
-      if (not last_was_digit) rpt_count=0;
-      rpt_count = 10*rpt_count+key-'0';
-      record.clear();
-      vdebug("rec", rpt_count);
-      last_was_digit=true;
-      return;
+      uint32_t h = ((s[i]<<16 | s[i+1]<<8 | s[i+2]) * 2654435761u) >> (32-lzf_hash_bits);
+      uint16_t back = i+1-table[h];  // modulo 65536
+      if (table[h] and back and back <= i) ref = i+1-back;
+      table[h] = i+1;
     }
-    last_was_digit=false;
-    if ((key>=' ' and key<256 and key!=':'))
+    if (ref and i+1-ref <= 8192 and memcmp(s+ref-1, s+i, 3) == 0)
     {
-      scmd += (char)key;
-      cmd = getAction(scmd.c_str());
-      vdebug("scmd", scmd << ", cmd " << (int)cmd);
-      switch(cmd)
+      size_t from = ref-1;
+      size_t len = 3;
+      size_t max = std::min<size_t>(n-i, 264);
+      while(len < max and s[from+len] == s[i+len]) len++;
+      size_t off = i-from-1;
+      if (len-2 < 7)
+        out.push_back((len-2) << 5 | off >> 8);
+      else
       {
-        case Action::VIM_INSERT: setMode(INSERT); break;
-        case Action::VIM_REPLACE: setMode(REPLACE); break;
-        case Action::VIM_REPEAT: play(record, 1); break;
-        case Action::VIM_UNKNOWN:
-          scmd.clear();
-          break;
-        case Action::VIM_UNTERMINATED:
-          vdebug("unterminated", scmd);
-          return;
-        default:
-          if (wbuff)
-          {
-            wbuff->onAction(cmd, win, *this);
-          }
-          break;
+        out.push_back(7 << 5 | off >> 8);
+        out.push_back(len-9);
       }
-      scmd.clear();
-      return;
+      out.push_back(off & 0xFF);
+      lits = 0;
+      i += len;
+    }
+    else
+    {
+      if (lits == 0)
+      {
+        lit = out.size();
+        out.push_back(0);
+      }
+      out.push_back(s[i++]);
+      out[lit] = lits++;
+      if (lits == 32) lits = 0;
     }
-    else if (wbuff and cmd!=Action::VIM_UNKNOWN)
-      wbuff->onAction(cmd, win, *this);
   }
-  else
+}
+
+void Buffer::lzfUnpack(const std::vector<uint8_t>& in, string& out)
+{
+  for(size_t i=0; i<in.size();)
   {
-    last_was_digit=false;
+    uint8_t c = in[i++];
+    if (c < 32)
+    {
+      out.append((const char*)&in[i], c+1);
+      i += c+1;
+      continue;
+    }
+    size_t len = c >> 5;
+    if (len == 7) len += in[i++];
+    size_t from = out.length() - ((c & 31) << 8 | in[i++]) - 1;
+    for(len += 2; len; len--) out += out[from++];
   }
-  if (wbuff) wbuff->onKey(key, win, *this);
 }
 
-void Vim::onMouse(const TinyTerm::MouseEvent& e)
+std::map<Cursor::type, Buffer::Packed>::iterator Buffer::packedAt(Cursor::type row) const
 {
+  auto it = packed.upper_bound(row);
+  if (it == packed.begin()) return packed.end();
+  --it;
+  return row < it->first+it->second.count ? it : packed.end();
 }
 
-Splitter::Splitter(bool vertical, uint16_t size)
-  : side_1(nullptr), side_0(nullptr)
+void Buffer::loadBlock(Cursor::type row) const
 {
-  split_.vertical = vertical;
-  split_.size = size;
+  auto it = packedAt(row);
+  if (it == packed.end() or it->second.loaded) return;
+  Packed& block = it->second;
+  uint32_t start = micros();
+  string raw;
+  raw.reserve(block.size);
+  lzfUnpack(block.data, raw);
+  size_t pos = 0;
+  for(Cursor::type i=0; i<block.count; i++)
+  {
+    size_t end = std::min(raw.find('\n', pos), raw.length());
+    buffer[it->first-1+i].assign(raw, pos, end-pos);
+    pos = end+1;
+  }
+  block.loaded = true;
+  block.load_us = micros()-start;
+  pack_loads++;
+  pack_load_us += block.load_us;
+  pack_load_max = std::max(pack_load_max, block.load_us);
+  pack_done = false;
+  vdebug("unpack", it->first << ' ' << block.size << '/' << block.data.size() << ' ' << block.load_us << "us");
+  pack_loaded.push_back(it->first);
 }
 
-Splitter::~Splitter()
+// The oldest blocks loaded are freed, unless they are shown. Not during
+// a checkpoint: the rows it has still to write stay as they are.
+void Buffer::releaseBlocks() const
 {
-  delete side_1;
-  delete side_0;
+  if (checkpoint_file) return;
+  while(pack_loaded.size() > pack_cache)
+  {
+    Cursor::type first = pack_loaded.front();
+    pack_loaded.erase(pack_loaded.begin());
+    auto old = packed.find(first);
+    if (old != packed.end() and old->second.loaded and cold(first, first+old->second.count-1))
+      unloadBlock(old->first, old->second);
+  }
 }
 
-Splitter* Splitter::split(Wid wid, char v_h, uint16_t size)
+void Buffer::unloadBlock(Cursor::type first, Packed& block) const
 {
-  bool vertical = v_h == 'v';
-  bool side_1;
-  Splitter* sthis=this;
-  Splitter** splitter=&sthis;
-  while((wid & 0x7FFF) and *splitter)
+  for(Cursor::type row=first; row<first+block.count; row++)
+    string().swap(buffer[row-1]);
+  block.loaded = false;
+}
+
+bool Buffer::packBlock(Cursor::type first, Cursor::type last, uint16_t* table)
+{
+  string raw;
+  for(Cursor::type row=first; row<=last; row++)
   {
-    side_1 = wid & 0x8000;
-    if (side_1) splitter=&((*splitter)->side_1);
-    else splitter = &((*splitter)->side_0);
-    wid <<=1;
+    const string& line = buffer[row-1];
+    if (line.find('\n') != string::npos) return false;
+    if (row > first) raw += '\n';
+    raw += line;
   }
-  if (*splitter==this) return nullptr;
-  if (*splitter)
-    (*splitter)->split_.size = size;
-  *splitter = new Splitter(vertical, size);
-  return *splitter;
+  Packed block;
+  block.count = last-first+1;
+  block.size = raw.length();
+  lzfPack(raw, block.data, table);
+  if (block.data.size()*4 > raw.length()*3) return false;  // not worth it
+  block.data.shrink_to_fit();
+  auto it = packed.emplace(first, std::move(block)).first;
+  unloadBlock(first, it->second);
+  return true;
 }
 
-void Window::calcSplitWids(Wid wid, Wid& wid_0, Wid& wid_1)
+void Buffer::unpack(Cursor::type row)
 {
-  Wid win_bit = wid-(wid & (wid-1)); // (last bit of cur_wid)
-  wid |= win_bit>>1;
-  wid_0 = wid & ~win_bit;
-  wid_1 = wid;
+  auto it = packedAt(row);
+  if (it == packed.end()) return;
+  loadBlock(row);
+  for(auto& slot: pack_loaded)
+    if (slot == it->first) slot = 0;
+  packed.erase(it);
 }
 
-void Splitter::draw(Window win, TinyTerm& term, Wid wid)
+void Buffer::shiftPacked(Cursor::type from, int32_t delta)
 {
-  Wid wid_0;
-  Wid wid_1;
-  Window::calcSplitWids(wid, wid_0, wid_1);
-  TypeSize& split = split_;
-  #if 0
-  auto printWid = [](const Window& win, Wid wid){};
-  #else
-  auto printWid = [&term](const Window& win, Wid wid)
+  for(auto& slot: pack_loaded)
+    if (slot >= from) slot += delta;
+  std::map<Cursor::type, Packed> moved;
+  auto it = packed.lower_bound(from);
+  while(it != packed.end())
   {
-      term.gotoxy(win.top+win.height/2,win.left+win.width/2-4);
-      term << ' ' << hex(wid) << ' ';
-      term.gotoxy(win.top+win.height/2+1,win.left+win.width/2-6);
-      term << ' ' << win << ' ';
-  };
-  #endif
-  if (split.vertical)
+    auto node = packed.extract(it++);
+    node.key() += delta;
+    moved.insert(moved.end(), std::move(node));
+  }
+  packed.merge(moved);
+}
+
+bool Buffer::cold(Cursor::type first, Cursor::type last) const
+{
+  // Rows of the windows (not taller than 2*pack_lines) and around the cursors
+  for(auto& it: wbuffs)
   {
-    term.gotoxy(win.top, win.left+split.size);
-    for(int i=win.top; i < win.top+win.height; i++)
+    Cursor::type top = it.second->topRow();
+    Cursor::type row = it.second->buffCursor().row;
+    if (last+pack_lines >= top and first <= top+2*pack_lines) return false;
+    if (last+pack_lines >= row and first <= row+pack_lines) return false;
+  }
+  return true;
+}
+
+void Buffer::pack(uint32_t deadline)
+{
+  if (pack_done or view_ or busy() or checkpoint_file or lines() < pack_min) return;
+  pack_next = pack_next > lines() ? 1 : (pack_next-1)/pack_lines*pack_lines+1;
+  Cursor::type start = pack_next;
+  std::vector<uint16_t> table;  // of lzfPack
+  do
+  {
+    Cursor::type first = pack_next;
+    Cursor::type last = first+pack_lines-1;
+    pack_next = last < lines() ? last+1 : 1;
+    if (last > lines() or not cold(first, last)) continue;
+    auto it = packed.upper_bound(last);
+    if (it != packed.begin() and (--it)->first+it->second.count > first)
     {
-      term << "\u2502\033[1B\033[1D";
+      // blocks are moved by the edits above them
+      Cursor::type end = it->first+it->second.count-1;
+      if (it->second.loaded and cold(it->first, end)) unloadBlock(it->first, it->second);
     }
+    else
+    {
+      if (table.empty()) table.resize(lzf_table);
+      packBlock(first, last, table.data());
+    }
+    if (millis() >= deadline) return;
+  } while(pack_next != start);
+  pack_done = true;
+}
 
-    Window w1(win.top, win.left, split.size, win.height);
-    if (side_1) side_1->draw(w1, term, wid_1);
-    else printWid(w1, wid_1);
+string Buffer::packInfo() const
+{
+  uint64_t size = 0;
+  uint64_t data = 0;
+  for(const auto& it: packed)
+  {
+    size += it.second.size;
+    data += it.second.data.size();
+  }
+  string info = std::to_string(packed.size()) + " blocks packed";
+  if (size)
+    info += ", " + std::to_string(size/1024) + "K -> " + std::to_string(data/1024)
+      + "K (" + std::to_string(data*100/size) + "%)";
+  if (pack_loads)
+    info += ", " + std::to_string(pack_loads) + " loads "
+      + std::to_string(pack_load_us/pack_loads) + "us (max " + std::to_string(pack_load_max) + "us)";
+  return info;
+}
 
-    win.left += split.size + 1;
-    win.width += split.size - 1;
-    if (side_0) side_0->draw(win, term, wid_0);
-    else printWid(win, wid_0);
+std::string Buffer::deleteLine(Cursor::type line)
+{
+  if (line<1 or line>lines()) return "";
+  unpack(line);
+  std::string s=std::move(buffer[line-1]);
+  deleteLines(line, line);
+  return s;
+}
+
+void Buffer::deleteLines(Cursor::type first, Cursor::type last)
+{
+  if (first<1) first=1;
+  if (last>lines()) last=lines();
+  if (last<first or view_) return;
+  modified_ = true;
+  journalOp('D', first, last);
+  touch(first, std::numeric_limits<Cursor::type>::max());
+  deleteMarks(first, last);
+  bracket_depths.erase(bracket_depths.lower_bound(first), bracket_depths.upper_bound(last));
+  shiftBrackets(last+1, first-last-1);
+  if (packed.size())
+  {
+    unpack(first);  // blocks cut by the deletion
+    unpack(last);
+    for(auto& slot: pack_loaded)
+      if (slot >= first and slot <= last) slot = 0;
+    packed.erase(packed.lower_bound(first), packed.upper_bound(last));
+    shiftPacked(last+1, first-last-1);
+  }
+  buffer.erase(buffer.begin()+first-1, buffer.begin()+last);
+  if (eols.size()) eols.erase(eols.begin()+first-1, eols.begin()+last);
+  if (first > lexed)
+    ;
+  else if (last < lex_first)
+  {
+    Cursor::type count = last-first+1;
+    lex_first -= count;
+    lexed -= count;
+    stale_first -= count;
+    stale_last -= count;
   }
+  else if (first < lex_first)
+    resetSyntax();
   else
   {
-    term.gotoxy(win.top+split.size, win.left);
-    for(int i=0; i < win.width; i++) term << "\u2500";
+    Cursor::type count = std::min(last, lexed)-first+1;
+    eol_states.erase(eol_states.begin()+first-lex_first, eol_states.begin()+first-lex_first+count);
+    lexed -= count;
+    if (stale_first <= lexed) stale_last = lexed;
+    syntaxChanged(first);
+  }
+}
 
-    Window w1(win.top, win.left, win.width, split.size);
-    if (side_1) side_1->draw(w1, term, wid_1);
-    else printWid(w1, wid_1);
+void Buffer::insertLines(Cursor::type line, Cursor::type count)
+{
+  if (line<1 or count<1 or view_) return;
+  modified_ = true;
+  journalOp('I', line, count > 1 ? count : 0);
+  touch(line, std::numeric_limits<Cursor::type>::max());
+  if (line > lines())
+  {
+    if (eols.size()) eols.resize(line+count-1, eol_);
+    buffer.resize(line+count-1);
+  }
+  else
+  {
+    unpack(line);
+    buffer.insert(buffer.begin()+line-1, count, string());
+    if (eols.size()) eols.insert(eols.begin()+line-1, count, eol_);
+    shiftMarks(line, count);
+    shiftBrackets(line, count);
+    shiftPacked(line, count);
+  }
+  if (line > lexed)
+    ;
+  else if (line <= lex_first)
+  {
+    lex_first += count;
+    lexed += count;
+    stale_first += count;
+    stale_last += count;
+  }
+  else
+  {
+    // The empty lines end with the state that starts the next one
+    uint8_t state = stateBefore(line);
+    eol_states.insert(eol_states.begin()+line-lex_first, count, state);
+    lexed += count;
+    if (stale_first <= lexed) stale_last = lexed;
+    syntaxChanged(line);
+  }
+}
 
-    win.height += - split.size - 1;
-    win.top += split.size+1;
-    if (side_0) side_0->draw(win, term, wid_0);
-    else printWid(win, wid_0);
+string& Buffer::takeLine(Cursor::type line)
+{
+  static string outside;
+  if (line<1 or view_) { outside.clear(); return outside; }
+  modified_ = true;
+  if (journaling) journal_rows.insert(line);
+  bracket_depths.erase(line);
+  touch(line, line);
+  syntaxChanged(line);
+  if (line > lines())
+  {
+    buffer.resize(line);
+    if (eols.size()) eols.resize(line, eol_);
   }
+  unpack(line);
+  return buffer[line-1];
 }
 
-void Splitter::dump2(Window from)
+const string& Buffer::getLine(Cursor::type line) const
 {
-  forEachWindow(from,
-    [](const Window& win, Wid wid, const Splitter* splitter) -> bool
+  static string empty;
+  if (line<1 or line>lines()) return empty;
+  if (view_) return viewLine(line);
+  if (buffer[line-1].empty() and packed.size()) loadBlock(line);
+  return buffer[line-1];
+}
+
+void Buffer::indexLine(uint32_t offset)
+{
+  if (view_index.size() == view_index_max)
+  {
+    for(size_t i=1; i<view_index_max/2; i++) view_index[i] = view_index[2*i];
+    view_index.resize(view_index_max/2);
+    view_step *= 2;
+  }
+  if (view_done % view_step == 0) view_index.push_back(offset);
+}
+
+bool Buffer::follow(bool on)
+{
+  if (not view_ or hex_) return false;
+  follow_ring.clear();
+  follow_head = 0;
+  io_line = on and view_tail and not loading() ? getLine(view_lines) : "";
+  follow_sync = on and loading();  // the scan is in the middle of a line
+  following_ = on;
+  return true;
+}
+
+bool Buffer::poll(uint32_t deadline)
+{
+  if (not following_ or (busy() and not follow_scan)) return false;
+  uint32_t scanned = view_pos;
+  if (not io_file)
+  {
+    uint32_t size = view_file.size();
+    if (size == view_pos) return false;
+    if (size < view_pos)
     {
-      Term << wid << ' ' << win << endl;
-      return true;
+      error("File truncated");
+      following_ = false;
+      return false;
     }
-  );
+    io_file = FILE_SYSTEM.open(filename_.c_str(), "r");
+    if (not io_file or not io_file.seek(view_pos))
+    {
+      io_file.close();
+      return false;
+    }
+    io_size = size;
+    follow_scan = true;
+    // The blocks holding the line without eol are read again
+    for(auto& block: view_blocks)
+      if (block.first + (Cursor::type)block.lines.size() > view_done) block.first = 0;
+    view_row = 0;
+  }
+  uint8_t progress;
+  ioSlice(deadline, progress);
+  return view_pos != scanned;
 }
 
-bool Splitter::forEachWindow(Window& from,
-  std::function<bool(const Window& win, Wid wid, const Splitter* cur_split)> fun,
-  Wid wid)
+// Same ends of lines as the scan: LF, CR, CRLF or line_max bytes
+bool Buffer::readViewLine(string* line) const
 {
-  Wid wid_0;
-  Wid wid_1;
-  Window::calcSplitWids(wid, wid_0, wid_1);
-  TypeSize& split = split_;
-  Window win = from;
-  if (split.vertical)
+  if (line) line->clear();
+  uint16_t len = 0;
+  int c;
+  while((c = view_file.peek()) >= 0)
   {
-    win.width = split.size;
-    if (side_1)
+    if (len >= line_max and not isUtf8Cont(c)) break;
+    view_file.read();
+    if (c == '\n') break;
+    if (c == '\r')
     {
-      if (not side_1->forEachWindow(win, fun, wid_1)) return false;
+      if (view_file.peek() == '\n') view_file.read();
+      break;
     }
-    else if (not fun(win, wid_1, this)) return false;
+    len++;
+    if (line) *line += (char)c;
+  }
+  if (c < 0 and len == 0) return false;
+  view_row++;
+  return true;
+}
 
-    win.left = from.left+split.size+1;
-    win.width = from.width-split.size - 1;
-    if (side_0)
+string Buffer::hexRow(uint32_t offset, const uint8_t* bytes, size_t n)
+{
+  static const char* digits = "0123456789abcdef";
+  string row;
+  for(int8_t shift=28; shift>=0; shift-=4) row += digits[(offset >> shift) & 15];
+  row += ' ';
+  for(size_t i=0; i<hex_width; i++)
+  {
+    row += i % 8 ? "" : " ";
+    row += i < n ? digits[bytes[i] >> 4] : ' ';
+    row += i < n ? digits[bytes[i] & 15] : ' ';
+    row += ' ';
+  }
+  row += " |";
+  for(size_t i=0; i<n; i++) row += bytes[i] >= ' ' and bytes[i] < 127 ? (char)bytes[i] : '.';
+  return row + '|';
+}
+
+const string& Buffer::viewLine(Cursor::type row) const
+{
+  static string empty;
+  if (following_)
+  {
+    if (row > view_done and not follow_sync) return io_line;  // being written
+    Cursor::type ring_first = view_done - (Cursor::type)follow_ring.size() + 1;
+    if (row >= ring_first)  // the ring is empty until the first scan
+      return follow_ring.size() ? follow_ring[(follow_head + row-ring_first) % follow_ring.size()] : io_line;
+  }
+  Cursor::type first = (row-1)/view_block*view_block+1;
+  for(auto& block: view_blocks)
+    if (block.first == first and row-first < (Cursor::type)block.lines.size())
+      return block.lines[row-first];
+
+  ViewBlock& block = view_blocks[view_next];
+  view_next = (view_next+1) % 3;
+  block.first = first;
+  block.lines.clear();
+  if (hex_)
+  {
+    uint32_t offset = (first-1)*hex_width;
+    uint8_t bytes[hex_width];
+    size_t n = 0;
+    view_file.seek(offset);
+    while(block.lines.size() < view_block and (n = view_file.read(bytes, hex_width)))
     {
-      if (not side_0->forEachWindow(win, fun, wid_0)) return false;
+      block.lines.push_back(hexRow(offset, bytes, n));
+      offset += n;
     }
-    else if (not fun(win, wid_0, this)) return false;
   }
-  else
+  else if (view_row != first)  // else the file is there already (reading down)
   {
-    win.height = split.size;
-    if (side_1)
+    Cursor::type k = (first-1)/view_step;
+    view_file.seek(view_index[k]);
+    view_row = k*view_step+1;
+    while(view_row < first and readViewLine(nullptr));
+  }
+  string line;
+  while(block.lines.size() < view_block and view_row <= view_lines and readViewLine(&line))
+    block.lines.push_back(std::move(line));
+  if (row-first < (Cursor::type)block.lines.size()) return block.lines[row-first];
+  return empty;
+}
+
+void Buffer::placeMark(MarkId id, const Cursor& pos)
+{
+  removeMark(id);
+  marks.emplace(id, pos);
+  mark_rows.emplace(pos.row, id);
+}
+
+void Buffer::removeMark(MarkId id)
+{
+  auto it = marks.find(id);
+  if (it == marks.end()) return;
+  auto range = mark_rows.equal_range(it->second.row);
+  for(auto row = range.first; row != range.second; row++)
+    if (row->second == id) { mark_rows.erase(row); break; }
+  marks.erase(it);
+}
+
+void Buffer::shiftMarks(Cursor::type from, int32_t delta)
+{
+  // Same shift for all: moved nodes keep their order
+  std::multimap<Cursor::type, MarkId> moved;
+  auto it = mark_rows.lower_bound(from);
+  while(it != mark_rows.end())
+  {
+    auto node = mark_rows.extract(it++);
+    node.key() += delta;
+    marks[node.mapped()].row = node.key();
+    moved.insert(moved.end(), std::move(node));
+  }
+  mark_rows.merge(moved);
+}
+
+void Buffer::deleteMarks(Cursor::type first, Cursor::type last)
+{
+  std::multimap<Cursor::type, MarkId> moved;
+  auto it = mark_rows.lower_bound(first);
+  while(it != mark_rows.end() and it->first <= last)
+  {
+    MarkId id = it->second;
+    if (id >= 'a' and id <= 'z')
     {
-      if (not side_1->forEachWindow(win, fun, wid_1)) return false;
+      marks.erase(id);
+      it = mark_rows.erase(it);
+      continue;
     }
-    else if (not fun(win, wid_1, this)) return false;
+    auto node = mark_rows.extract(it++);
+    node.key() = first;
+    marks[id] = Cursor(first, 1);
+    moved.insert(std::move(node));
+  }
+  shiftMarks(last+1, first-last-1);
+  mark_rows.merge(moved);
+}
 
-    win.height = from.height - split.size - 1;
-    win.top = from.top + split.size+1;
-    if (side_0)
+void Buffer::setMark(char name, const Cursor& pos)
+{
+  if ((name >= 'a' and name <= 'z') or name == '\'') placeMark(name, pos);
+}
+
+bool Buffer::getMark(char name, Cursor& pos) const
+{
+  if (name == '`') name = '\'';
+  auto it = marks.find(name);
+  if (it == marks.end()) return false;
+  pos = it->second;
+  if (pos.row > lines()) pos.row = lines();
+  return true;
+}
+
+void Buffer::pushJump(const Cursor& pos)
+{
+  placeMark('\'', pos);
+  // One entry per line, the newest one
+  for(auto it = jumps.begin(); it != jumps.end(); it++)
+    if (marks[*it].row == pos.row)
     {
-      if (not side_0->forEachWindow(win, fun, wid_0)) return false;
+      removeMark(*it);
+      jumps.erase(it);
+      break;
     }
-    else if (not fun(win, wid_0, this)) return false;
+  if (jumps.size() == jump_max)
+  {
+    removeMark(jumps.front());
+    jumps.erase(jumps.begin());
+  }
+  while(marks.count(next_jump)) next_jump = next_jump == 0xFF ? jump_ids : next_jump+1;
+  placeMark(next_jump, pos);
+  jumps.push_back(next_jump);
+  jump_pos = jumps.size();
+}
+
+bool Buffer::jump(int8_t dir, Cursor& pos)
+{
+  if (dir < 0 and jump_pos == jumps.size())
+  {
+    // Ctrl-I comes back here
+    pushJump(pos);
+    jump_pos = jumps.size()-1;
   }
+  int16_t next = jump_pos + dir;
+  if (next < 0 or next >= (int16_t)jumps.size()) return false;
+  jump_pos = next;
+  pos = marks[jumps[next]];
+  if (pos.row > lines()) pos.row = lines();
   return true;
 }
 
-bool Splitter::calcWindow(Wid wid, Window& win, Splitter* splitter)
+void Buffer::shiftBrackets(Cursor::type from, int32_t delta)
 {
-  splitter = this;
-  while((wid & 0x7FFF) and splitter)
+  std::map<Cursor::type, BracketDepth> moved;
+  auto it = bracket_depths.lower_bound(from);
+  while(it != bracket_depths.end())
   {
-    TypeSize& split = splitter->split_;
-    bool side_1 = wid & 0x8000;
-    if (split.vertical) {
-      if (side_1) { win.left += split.size+1; win.width -= (split.size+1); }
-      else { win.width = split.size; }
-    }
-    else {
-      if (side_1) { win.height = split.size; }
-      else { win.top += split.size+1; win.height -= (split.size+1); }
-    };
-    if (side_1)
-      splitter=splitter->side_1;
+    auto node = bracket_depths.extract(it++);
+    node.key() += delta;
+    moved.insert(moved.end(), std::move(node));
+  }
+  bracket_depths.merge(moved);
+}
+
+const Buffer::BracketDepth& Buffer::bracketDepth(Cursor::type row, char open, char close) const
+{
+  if (open != bracket_open or bracket_depths.size() >= bracket_cache_max)
+  {
+    bracket_depths.clear();
+    bracket_open = open;
+  }
+  auto it = bracket_depths.find(row);
+  if (it != bracket_depths.end()) return it->second;
+  BracketDepth depth{0, 0, 0};
+  const string& line = getLine(row);
+  for(char c: line)
+  {
+    if (c == open) depth.delta++;
+    else if (c == close and --depth.delta < depth.fwd_min) depth.fwd_min = depth.delta;
+  }
+  int16_t back = 0;
+  for(size_t col = line.length(); col-- > 0;)
+  {
+    if (line[col] == close) back++;
+    else if (line[col] == open and --back < depth.back_min) depth.back_min = back;
+  }
+  return bracket_depths[row] = depth;
+}
+
+bool Buffer::findOpen(char open, char close, Cursor& pos) const
+{
+  int32_t depth = 0;
+  Cursor::type row = pos.row;
+  size_t col = std::min<size_t>(pos.col-1, getLine(row).length());
+  while(row >= 1)
+  {
+    // Other lines are scanned only if the bracket is there
+    if (row != pos.row and depth + bracketDepth(row, open, close).back_min >= 0)
+      depth -= bracketDepth(row, open, close).delta;
     else
-      splitter=splitter->side_0;
-    wid <<= 1;
+    {
+      const string& line = getLine(row);
+      while(col-- > 0)
+      {
+        if (line[col] == close)
+          depth++;
+        else if (line[col] == open and depth-- == 0)
+        {
+          pos = Cursor(row, col+1);
+          return true;
+        }
+      }
+    }
+    if (--row >= 1) col = getLine(row).length();
   }
-  while(splitter)
+  return false;
+}
+
+bool Buffer::findClose(char open, char close, Cursor& pos) const
+{
+  int32_t depth = 0;
+  Cursor::type row = pos.row;
+  size_t col = pos.col;  // after pos
+  while(row <= lines())
   {
-    vdebug("split", "should not be here " << hex(wid));
-    if (splitter->split_.vertical)
-      win.width = splitter->split_.size;
+    if (row != pos.row and depth + bracketDepth(row, open, close).fwd_min >= 0)
+      depth += bracketDepth(row, open, close).delta;
     else
-      win.height = splitter->split_.size;
-    splitter = splitter->side_1;
+    {
+      const string& line = getLine(row);
+      for(; col < line.length(); col++)
+      {
+        if (line[col] == open)
+          depth++;
+        else if (line[col] == close and depth-- == 0)
+        {
+          pos = Cursor(row, col+1);
+          return true;
+        }
+      }
+    }
+    row++;
+    col = 0;
   }
-  return wid==0x8000;
+  return false;
 }
 
-void Splitter::close(Wid)
+void Buffer::redraw(Wid wid, TinyTerm* term, Splitter* splitter)
 {
+  Window win(1,1,term->sx, term->sy);
+  if (splitter->calcWindow(wid, win))
+  {
+    auto wit=wbuffs.find(wid);
+    if (wit!=wbuffs.end())
+    {
+      wit->second->draw(win, *term);
+      wit->second->focus(win, *term);
+    }
+  }
+  else
+    error("Buffer::redraw");
 }
 
-Wid Splitter::findWindow(Window& term, const Cursor& point)
+bool Buffer::load(const char* filename, Mode mode)
 {
-  Wid win=0;
-  forEachWindow(term,
-    [&point,&win](const Window& candidate, Wid wid, const Splitter* splitter) -> bool
+  io_file = FILE_SYSTEM.open(filename, "r");
+  if (!io_file)
+  {
+    error("Unable to open file");
+    return false;
+  }
+  io_size = io_file.size();
+  stamp(io_file);
+  io_line.clear();
+  io_cr = false;
+  view_ = mode != EDIT;
+  hex_ = mode == HEX;
+  if (view_)
+  {
+    view_file = FILE_SYSTEM.open(filename, "r");
+    view_index.assign(1, 0);
+    view_step = 16;
+    view_lines = view_done = 0;
+    view_pos = 0;
+    view_tail = view_cr = false;
+    view_len = 0;
+    view_row = 0;
+    for(auto& block: view_blocks) block.first = 0;
+    applySettings();  // no syntax
+  }
+  if (hex_)
+  {
+    // Rows are at fixed offsets, there is nothing to scan
+    view_lines = std::min<uint32_t>((io_size+hex_width-1)/hex_width, Cursor::lines_max);
+    io_file.close();
+  }
+  return true;
+}
+
+bool Buffer::save(std::string filename, bool force)
+{
+  if (busy()) return false;
+  bool overwrite = force;  // :w!
+  if (filename.length()==0) { filename = filename_; force=true; }
+  if (view_ and filename == filename_)
+  {
+    error("Read only");
+    return false;
+  }
+  if (filename.length())
+  {
+    if (eol_ == EOL_NONE) eol_ = EOL_CRLF;
+    Term << "TRYING " << filename << ", f=" << force << endl;
+    if (filename == filename_ and partial_ and not force)
+      error("File partially loaded");
+    else if (filename == filename_ and not overwrite and changedOnDisk())
+      error("File changed since read (:w! to write)");
+    else if (force or not FILE_SYSTEM.exists(filename.c_str()))
+    {
+      io_file = FILE_SYSTEM.open((filename+'~').c_str(), "w");
+      if (not io_file) return false;
+      io_name = filename;
+      io_row = 1;
+      return true;
+    }
+    else
+      error("File exists");
+  }
+  return false;
+}
+
+void Buffer::stamp(File& file)
+{
+  disk_size = file.size();
+  disk_time = file.getLastWrite();
+}
+
+bool Buffer::changedOnDisk()
+{
+  File file = FILE_SYSTEM.open(filename_.c_str(), "r");
+  if (not file) return false;  // nothing to overwrite
+  bool changed = file.size() != disk_size or file.getLastWrite() != disk_time;
+  file.close();
+  return changed;
+}
+
+bool Buffer::ioSlice(uint32_t deadline, uint8_t& progress, Cursor::type rows)
+{
+  if (not io_file) return false;
+  if (io_name.empty() and view_)
+  {
+    Cursor::type first = view_done+1;  // a line without eol grows (follow)
+    uint32_t scanned = view_pos;
+    uint8_t chunk[128];
+    size_t n = 0;
+    while(not (rows and view_done >= rows) and (n = io_file.read(chunk, sizeof(chunk))))
+    {
+      for(size_t i=0; i<n; i++)
+      {
+        char c = chunk[i];
+        bool add;
+        Eol eol = endOfLine(c, view_cr, add);
+        if (add and view_len >= line_max and not isUtf8Cont(c)) eol = EOL_SPLIT;
+        if (eol)
+        {
+          view_tail = false;
+          view_len = 0;
+          if (following_)
+          {
+            if (follow_sync)
+              follow_sync = false;
+            else if (follow_ring.size() < follow_max)
+              follow_ring.push_back(io_line);
+            else
+            {
+              follow_ring[follow_head] = io_line;
+              follow_head = (follow_head+1) % follow_max;
+            }
+            io_line.clear();
+          }
+          // the next line starts after the eol, or at c if c ended a CR
+          bool at_c = eol == EOL_CR or eol == EOL_SPLIT;
+          if (++view_done % view_step == 0) indexLine(view_pos+i+(at_c ? 0 : 1));
+        }
+        if (add)
+        {
+          view_tail = true;
+          view_len++;
+          if (following_ and not follow_sync) io_line += c;
+        }
+      }
+      view_pos += n;
+      if (view_done >= Cursor::lines_max)
+      {
+        error("Document too long");
+        ioCancel();
+        break;
+      }
+      if (millis() >= deadline) break;
+    }
+    view_lines = view_done + (view_tail or view_cr ? 1 : 0);  // (no eol)
+    if (io_file and view_pos >= io_size)
+    {
+      io_file.close();
+      follow_scan = false;
+    }
+    if (view_pos != scanned) touch(first, std::numeric_limits<Cursor::type>::max());
+    if (not busy()) return false;
+    progress = (uint64_t)view_pos*100/io_size;
+    return true;
+  }
+  if (io_name.empty())
+  {
+    Cursor::type first = lines()+1;
+    uint8_t chunk[128];
+    size_t n = 0;
+    while(not (rows and lines() >= rows) and (n = io_file.read(chunk, sizeof(chunk))))
+    {
+      for(size_t i=0; i<n; i++)
+      {
+        bool add;
+        Eol eol = endOfLine(chunk[i], io_cr, add);
+        if (eol) pushLine(eol);
+        if (not add) continue;
+        if (io_line.length() >= line_max and not isUtf8Cont(chunk[i])) pushLine(EOL_SPLIT);
+        io_line += (char)chunk[i];
+      }
+      if (lines() >= Cursor::lines_max)
+      {
+        error("Document too long (don't save it)");
+        ioCancel();
+        break;
+      }
+      if (millis() >= deadline) break;
+    }
+    if (io_file and io_file.position() >= io_size)
+    {
+      if (io_cr) pushLine(EOL_CR);
+      else if (io_line.length()) pushLine(EOL_NONE);
+      io_cr = false;
+      io_file.close();
+    }
+    if (lines() >= first) touch(first, std::numeric_limits<Cursor::type>::max());
+    if (not busy()) return false;
+    progress = (uint64_t)io_file.position()*100/io_size;
+    return true;
+  }
+
+  auto eol = [this](Cursor::type row)
+  {
+    Eol eol = eolOf(row);
+    if (eol == EOL_CR or eol == EOL_CRLF) io_file.write('\r');
+    if (eol == EOL_LF or eol == EOL_CRLF) io_file.write('\n');
+  };
+  string raw;
+  while(io_row <= lines())
+  {
+    // packed blocks are written without loading them
+    auto it = packed.find(io_row);
+    if (it != packed.end() and not it->second.loaded)
+    {
+      raw.clear();
+      lzfUnpack(it->second.data, raw);
+      for(size_t pos=0; pos <= raw.length(); pos++)
+      {
+        size_t end = std::min(raw.find('\n', pos), raw.length());
+        io_file.write((const uint8_t*)raw.data()+pos, end-pos);
+        eol(io_row++);
+        pos = end;
+      }
+    }
+    else
+    {
+      const string& line = getLine(io_row);
+      io_file.write((const uint8_t*)line.data(), line.length());
+      eol(io_row++);
+    }
+    if (millis() >= deadline) break;
+  }
+  progress = io_row*100/(lines()+1);
+  if (io_row <= lines()) return true;
+  io_file.close();
+  FILE_SYSTEM.remove(io_name.c_str());
+  FILE_SYSTEM.rename((io_name+'~').c_str(), io_name.c_str());
+  Term << "WROTE " << lines() << " lines" << endl;
+  modified_ = false;
+  if (io_name == filename_)
+  {
+    partial_ = false;
+    closeJournal();
+    File file = FILE_SYSTEM.open(io_name.c_str(), "r");
+    if (file) stamp(file);
+    file.close();
+  }
+  io_name.clear();
+  return false;
+}
+
+Buffer::Eol Buffer::endOfLine(char c, bool& cr, bool& add)
+{
+  add = false;
+  if (cr)
+  {
+    cr = c == '\r';  // ends the line and may start a CRLF
+    if (c == '\n') return EOL_CRLF;
+    add = c != '\r';
+    return EOL_CR;
+  }
+  if (c == '\r')
+    cr = true;
+  else if (c == '\n')
+    return EOL_LF;
+  else
+    add = true;
+  return EOL_NONE;
+}
+
+void Buffer::pushLine(Eol eol)
+{
+  buffer.push_back(std::move(io_line));
+  io_line.clear();
+  if (eol == EOL_NONE)
+    eol_last = false;
+  else if (eol_ == EOL_NONE and eol != EOL_SPLIT)
+    eol_ = eol;
+  if (eols.empty() and eol != eol_ and eol != EOL_NONE)
+  {
+    eols.assign(lines()-1, eol_);
+    eols.push_back(eol);
+  }
+  else if (eols.size())
+    eols.push_back(eol);
+}
+
+// Saved end of row. Only the last line may have none.
+Buffer::Eol Buffer::eolOf(Cursor::type row) const
+{
+  Eol eol = eols.empty() ? eol_ : eols[row-1];
+  if (row == lines() and eols.empty() and not eol_last) return EOL_NONE;
+  if (eol == EOL_NONE and row < lines()) return eol_;
+  return eol;
+}
+
+void Buffer::ioCancel()
+{
+  if (not io_file) return;
+  io_file.close();
+  follow_scan = false;
+  if (io_name.length())
+  {
+    FILE_SYSTEM.remove((io_name+'~').c_str());
+    io_name.clear();
+  }
+  else
+    partial_ = true;
+}
+
+// Journal records, one per '\n' terminated line:
+//   F          base is the file as read
+//   B<n>       base is the n following lines (snapshot)
+//   E<row> <e> ends of line of row and the next ones (Eol digits), written
+//              after a snapshot when they are not all the same
+//   S<row> <s> set the content of row
+//   I<row> [n] insert n (1) empty rows
+//   D<f> <l>   delete rows f to l
+// Empty lines (padding to journal_block) are ignored.
+void Buffer::openJournal(bool recovering)
+{
+  if (filename_.empty() or view_) return;
+  if (FILE_SYSTEM.exists(swapName().c_str()))
+  {
+    if (not recovering)
+    {
+      error("Swap file found, use -r to recover");
+      return;
+    }
+    if (not recover())
+    {
+      error("Unable to recover");
+      return;
+    }
+    journaling = true;
+    uint8_t progress;
+    if (startCheckpoint())
+      while(checkpoint(std::numeric_limits<uint32_t>::max(), progress));
+    return;
+  }
+  journaling = true;
+}
+
+bool Buffer::recover()
+{
+  File file = FILE_SYSTEM.open(swapName().c_str(), "r");
+  if (not file) return false;
+  Cursor::type base = 0;  // snapshot lines left to read
+  string rec;
+  while (file.available())
+  {
+    char c = file.read();
+    if (c != '\n')
+    {
+      rec += c;
+      continue;
+    }
+    if (base)
+    {
+      takeLine(lines()+1) = rec;
+      base--;
+    }
+    else if (rec.length())
+    {
+      Cursor::type row = atoi(rec.c_str()+1);
+      size_t sep = rec.find(' ');
+      switch(rec[0])
+      {
+        case 'B':
+          deleteLines(1, lines());
+          base = row;
+          break;
+        case 'S':
+          if (row >= 1 and sep != string::npos) takeLine(row) = rec.substr(sep+1);
+          break;
+        case 'I':
+          insertLines(row, sep != string::npos ? atoi(rec.c_str()+sep+1) : 1);
+          break;
+        case 'D':
+          if (sep != string::npos) deleteLines(row, atoi(rec.c_str()+sep+1));
+          break;
+        case 'E':
+          if (row < 1 or sep == string::npos) break;
+          if (eols.empty()) eols.assign(lines(), eol_);
+          for(size_t i=sep+1; i<rec.length() and row<=lines(); i++, row++)
+            eols[row-1] = (Eol)(rec[i]-'0');
+          break;
+      }
+    }
+    rec.clear();
+  }
+  return true;
+}
+
+void Buffer::journalRows()
+{
+  if (journal_rows.empty()) return;
+  if (journal_.empty() and journal_size==0) journal_ = "F\n";
+  size_t from = journal_.length();
+  for(Cursor::type row: journal_rows)
+  {
+    journal_ += 'S' + std::to_string(row) + ' ';
+    journal_ += getLine(row);
+    journal_ += '\n';
+  }
+  journal_rows.clear();
+  if (checkpoint_file) checkpoint_tail.append(journal_, from, string::npos);
+}
+
+void Buffer::journalOp(char op, Cursor::type first, Cursor::type last)
+{
+  if (not journaling) return;
+  journalRows();
+  // The lines not written yet in the snapshot would have moved
+  if (checkpoint_file) checkpointCancel();
+  if (journal_.empty() and journal_size==0) journal_ = "F\n";
+  journal_ += op + std::to_string(first);
+  if (last) journal_ += ' ' + std::to_string(last);
+  journal_ += '\n';
+}
+
+void Buffer::journal(bool idle)
+{
+  if (not journaling) return;
+  // A line being edited is recorded once, when the user pauses
+  if (idle) journalRows();
+  if (journal_.empty()) return;
+  if (idle) journal_.append((journal_block - journal_.length() % journal_block) % journal_block, '\n');
+  size_t len = journal_.length() - journal_.length() % journal_block;
+  if (len == 0) return;
+  File file = FILE_SYSTEM.open(swapName().c_str(), "a");
+  if (not file or file.write((const uint8_t*)journal_.data(), len) != len)
+  {
+    journaling = false;
+    error("Unable to write swap file");
+    return;
+  }
+  file.close();
+  journal_.erase(0, len);
+  journal_size += len;
+}
+
+bool Buffer::checkpointDue() const
+{
+  uint32_t base = journal_base ? journal_base : disk_size;
+  return journaling and not checkpoint_file and
+    journal_size + journal_.length() > journal_base + std::max<uint32_t>(base, journal_max);
+}
+
+// The journal is replaced by a snapshot of the buffer (written
+// aside then renamed, so a reset leaves one of them complete)
+bool Buffer::startCheckpoint()
+{
+  checkpoint_file = FILE_SYSTEM.open((swapName() + '~').c_str(), "w");
+  if (not checkpoint_file)
+  {
+    journaling = false;
+    error("Unable to write swap file");
+    return false;
+  }
+  string head = 'B' + std::to_string(lines()) + '\n';
+  checkpoint_file.write((const uint8_t*)head.data(), head.length());
+  checkpoint_size = head.length();
+  checkpoint_row = 0;
+  checkpoint_eols = 0;
+  checkpoint_tail.clear();
+  return true;
+}
+
+bool Buffer::checkpoint(uint32_t deadline, uint8_t& progress)
+{
+  if (not checkpoint_file) return false;
+  string raw;
+  while(checkpoint_row < lines())
+  {
+    Cursor::type row = checkpoint_row+1;
+    const string* line = &buffer[row-1];
+    auto it = packedAt(row);
+    if (it != packed.end() and not it->second.loaded)
+    {
+      // The rest of the block, from row
+      raw.clear();
+      lzfUnpack(it->second.data, raw);
+      size_t start = 0;
+      for(Cursor::type r=it->first; r<row; r++) start = raw.find('\n', start)+1;
+      raw.erase(0, start);
+      line = &raw;
+      row = it->first+it->second.count-1;
+    }
+    checkpoint_file.write((const uint8_t*)line->data(), line->length());
+    checkpoint_file.write('\n');
+    checkpoint_size += line->length()+1;
+    checkpoint_row = row;
+    if (millis() >= deadline) break;
+  }
+  while(checkpoint_row == lines() and checkpoint_eols < eols.size())
+  {
+    string rec = 'E' + std::to_string(checkpoint_eols+1) + ' ';
+    for(uint16_t n=0; n<eols_record and checkpoint_eols < eols.size(); n++)
+      rec += (char)('0' + eols[checkpoint_eols++]);
+    rec += '\n';
+    checkpoint_file.write((const uint8_t*)rec.data(), rec.length());
+    checkpoint_size += rec.length();
+    if (millis() >= deadline) break;
+  }
+  progress = lines() ? (uint64_t)checkpoint_row*100/lines() : 100;
+  if (checkpoint_row < lines() or checkpoint_eols < eols.size()) return true;
+
+  for(; checkpoint_size % journal_block; checkpoint_size++) checkpoint_file.write('\n');
+  checkpoint_file.close();
+  FILE_SYSTEM.remove(swapName().c_str());
+  FILE_SYSTEM.rename((swapName() + '~').c_str(), swapName().c_str());
+  journal_.swap(checkpoint_tail);
+  checkpoint_tail.clear();
+  journal_size = journal_base = checkpoint_size;
+  return false;
+}
+
+void Buffer::checkpointCancel()
+{
+  if (not checkpoint_file) return;
+  checkpoint_file.close();
+  FILE_SYSTEM.remove((swapName() + '~').c_str());
+  checkpoint_tail.clear();
+}
+
+void Buffer::closeJournal()
+{
+  checkpointCancel();
+  journal_.clear();
+  journal_rows.clear();
+  if (journal_size) FILE_SYSTEM.remove(swapName().c_str());
+  journal_size = journal_base = 0;
+}
+
+void Vim::error(const char* err)
+{
+  tiny_vim::error(err);
+  message(err, true);
+}
+
+WindowBuffer* Vim::getWBuff(Wid wid)
+{
+  for(auto &buff: buffers)
+  {
+    WindowBuffer* wbuff = buff.second->getWBuff(viewId(wid));
+    if (wbuff) return wbuff;
+  }
+  return nullptr;
+}
+
+void Vim::setMode(uint8_t mode)
+{
+  if (settings.mode != mode)
+  {
+    if ((mode | settings.mode) & VISUAL_MODE)
+    {
+      Window win;
+      WindowBuffer* wbuff = getWBuff(curwid);
+      if (wbuff and calcWindow(curwid, win))
+        wbuff->visual(mode & VISUAL_MODE ? mode : 0, win);
+    }
+    settings.mode = mode;
+
+    // TODO draw status in status bar
+    vdebug("mode",mode);
+    // TODO draw status
+  }
+}
+
+bool Vim::calcWindow(Wid wid, Window& win)
+{
+  win=Window(1,1, term->sx, term->sy);
+  return splitter.calcWindow(wid, win);
+}
+
+// Record format: one byte per key, KeyCodes >= 0xFF are stored
+// as 0xFF followed by the 16 bits code (lsb first).
+static void recordKey(Vim::Record& rec, TinyTerm::KeyCode key)
+{
+  if (key < 0xFF)
+    rec += (char)key;
+  else
+  {
+    rec += (char)0xFF;
+    rec += (char)(key & 0xFF);
+    rec += (char)(key >> 8);
+  }
+}
+
+static TinyTerm::KeyCode nextKey(const Vim::Record& rec, size_t& index)
+{
+  uint16_t key = (uint8_t)rec[index++];
+  if (key == 0xFF and index+1 < rec.length())
+  {
+    key = (uint8_t)rec[index] | ((uint8_t)rec[index+1] << 8);
+    index += 2;
+  }
+  return (TinyTerm::KeyCode)key;
+}
+
+static bool isMotion(Action action)
+{
+  switch(action)
+  {
+    case Action::VIM_MOVE_LEFT: case Action::VIM_MOVE_DOWN: case Action::VIM_MOVE_UP:
+    case Action::VIM_MOVE_RIGHT: case Action::VIM_NEXT_WORD: case Action::VIM_PREV_WORD:
+    case Action::VIM_MOVE_LINE_END: case Action::VIM_MOVE_DOC_END: case Action::VIM_MOVE_LINE_BEGIN:
+    case Action::VIM_WORD_END: case Action::VIM_NEXT_BIGWORD: case Action::VIM_PREV_BIGWORD:
+    case Action::VIM_BIGWORD_END: case Action::VIM_FIND_REPEAT: case Action::VIM_FIND_REVERSE:
+    case Action::VIM_MATCH_PAIR: case Action::VIM_PREV_PARAGRAPH: case Action::VIM_NEXT_PARAGRAPH:
+    case Action::VIM_MOVE_DOC_BEGIN: case Action::VIM_SCREEN_TOP: case Action::VIM_SCREEN_MIDDLE:
+    case Action::VIM_SCREEN_BOTTOM: case Action::VIM_HALF_PAGE_DOWN: case Action::VIM_HALF_PAGE_UP:
+    case Action::VIM_PAGE_DOWN: case Action::VIM_PAGE_UP:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Motions that feed the jump list
+static bool isJump(Action action)
+{
+  switch(action)
+  {
+    case Action::VIM_MOVE_DOC_END: case Action::VIM_MOVE_DOC_BEGIN: case Action::VIM_MATCH_PAIR:
+    case Action::VIM_PREV_PARAGRAPH: case Action::VIM_NEXT_PARAGRAPH: case Action::VIM_SCREEN_TOP:
+    case Action::VIM_SCREEN_MIDDLE: case Action::VIM_SCREEN_BOTTOM:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static bool isOperator(char c) { return c and strchr("dcy<>=", c); }
+
+static bool isChange(Action action)
+{
+  switch(action)
+  {
+    case Action::VIM_INSERT: case Action::VIM_APPEND: case Action::VIM_REPLACE:
+    case Action::VIM_JOIN: case Action::VIM_CHANGE:
+    case Action::VIM_DELETE: case Action::VIM_PUT_AFTER: case Action::VIM_PUT_BEFORE:
+    case Action::VIM_OPEN_LINE:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// false (and an error) if the buffer cannot be changed now
+static bool editable(const Buffer& buff)
+{
+  if (buff.readOnly())
+    error("Read only");
+  else if (buff.busy())
+    error("Busy");
+  else
+    return true;
+  return false;
+}
+
+void Vim::resumeRender()
+{
+  if (suspended==0 or --suspended) return;
+  render();
+}
+
+void Vim::play(const Record& rec, uint32_t count)
+{
+  bool was_playing = playing;
+  playing = true;
+  suspendRender();
+  while(count)
+  {
+    count--;
+    size_t index=0;
+    while(index < rec.length()) onKey(nextKey(rec, index));
+  }
+  playing = was_playing;
+  resumeRender();
+}
+
+void Vim::play(const Change& chg, uint32_t count)
+{
+  if (chg.command.length()==0) return;
+  Change replay(chg);  // last_change is overwritten while playing
+  bool was_playing = playing;
+  playing = true;
+  suspendRender();
+  rpt_count = count;
+  play(replay.command);
+  play(replay.text);
+  if (settings.mode & EDIT_MODE) onKey(TinyTerm::KEY_ESC);
+  playing = was_playing;
+  resumeRender();
+}
+
+// q{reg} starts recording, @{reg} plays, @@ plays last played register
+// m{a-z} sets a mark, '{mark} and `{mark} go to its line or position
+// f t F T {char} move to the char
+void Vim::onRegister(Action action, char reg, uint32_t count)
+{
+  if (action == Action::VIM_FIND or action == Action::VIM_TILL or
+      action == Action::VIM_FIND_BACK or action == Action::VIM_TILL_BACK)
+  {
+    WindowBuffer* wbuff = getWBuff(curwid);
+    Window win;
+    last_find = { action, reg };
+    if (wbuff and calcWindow(curwid, win)) wbuff->onAction(action, win, *this, count);
+    return;
+  }
+  if (action == Action::VIM_MARK or action == Action::VIM_GOTO_MARK_LINE or action == Action::VIM_GOTO_MARK)
+  {
+    WindowBuffer* wbuff = getWBuff(curwid);
+    Window win;
+    if (wbuff == nullptr or not calcWindow(curwid, win)) return;
+    Buffer& buff = wbuff->buffer();
+    Cursor pos;
+    if (action == Action::VIM_MARK)
+      buff.setMark(reg, wbuff->buffCursor());
+    else if (not buff.getMark(reg, pos))
+      error("Mark not set");
+    else
+    {
+      if (action == Action::VIM_GOTO_MARK_LINE) pos.col = firstNonBlank(buff.getLine(pos.row));
+      wbuff->jumpTo(pos, win, *this);
+    }
+  }
+  else if (action == Action::VIM_RECORD)
+  {
+    if (isalnum(reg))
+    {
+      macro_reg = reg;
+      registers[reg].clear();
+    }
+  }
+  else if (action == Action::VIM_PLAY)
+  {
+    if (reg=='@') reg=last_reg;
+    auto it=registers.find(reg);
+    if (it == registers.end()) return;
+    last_reg = reg;
+    Record macro(it->second);  // the register may be recorded while playing
+    play(macro, count);
+  }
+}
+
+// End of insert / replace: a count given to the command repeats the text
+void Vim::endChange()
+{
+  if (not changing) return;
+  changing = false;
+  if (change.count > 1) play(change.text, change.count-1);
+  last_change = change;
+}
+
+void Vim::clip(const std::string& buff)
+{
+  clipboard_ = buff; 
+}
+
+char getChar(std::string& cmd)
+{
+  if (cmd.length()==0) return 0;
+  char c=cmd[0];
+  cmd.erase(0,1);
+  return c;
+}
+
+// Ex address: N . $ 'x, followed by +N -N offsets
+// 1 if found, 0 if none, -1 if a mark is not set
+static int8_t getAddress(string& cmd, const Buffer& buff, Cursor::type cur, int32_t& row)
+{
+  size_t i = 0;
+  if (cmd.length() and isdigit(cmd[0]))
+  {
+    row = 0;
+    while(i < cmd.length() and isdigit(cmd[i]) and row <= buff.lines()) row = 10*row + cmd[i++]-'0';
+    while(i < cmd.length() and isdigit(cmd[i])) i++;
+  }
+  else if (cmd.length() and cmd[0] == '.') { row = cur; i++; }
+  else if (cmd.length() and cmd[0] == '$') { row = buff.lines(); i++; }
+  else if (cmd.length() > 1 and cmd[0] == '\'')
+  {
+    Cursor pos;
+    if (not buff.getMark(cmd[1], pos)) return -1;
+    row = pos.row;
+    i = 2;
+  }
+  else if (cmd.length() and (cmd[0] == '+' or cmd[0] == '-'))
+    row = cur;
+  else
+    return 0;
+  while(i < cmd.length() and (cmd[i] == '+' or cmd[i] == '-'))
+  {
+    int sign = cmd[i++] == '+' ? 1 : -1;
+    int32_t n = 0;
+    if (i == cmd.length() or not isdigit(cmd[i])) n = 1;
+    while(i < cmd.length() and isdigit(cmd[i]) and n <= buff.lines()) n = 10*n + cmd[i++]-'0';
+    row += sign*n;
+  }
+  cmd.erase(0, i);
+  return 1;
+}
+
+int8_t Vim::getRange(string& cmd, const Buffer& buff, Cursor::type cur, Cursor::type& first, Cursor::type& last)
+{
+  int32_t from = cur;
+  int32_t to = cur;
+  int8_t count = 0;
+  if (cmd.length() and cmd[0] == '%')
+  {
+    cmd.erase(0, 1);
+    from = 1;
+    to = buff.lines();
+    count = 2;
+  }
+  else
+  {
+    int8_t found = getAddress(cmd, buff, cur, from);
+    if (found < 0) { error("Mark not set"); return -1; }
+    to = from;
+    count = found;
+    if (cmd.length() and (cmd[0] == ',' or cmd[0] == ';'))
+    {
+      if (cmd[0] == ';') cur = from;
+      cmd.erase(0, 1);
+      found = getAddress(cmd, buff, cur, to);
+      if (found < 0) { error("Mark not set"); return -1; }
+      count = found ? 2 : count;
+    }
+  }
+  if (from > to) std::swap(from, to);
+  if (count and (from < 1 or to > buff.lines()))
+  {
+    error("Invalid range");
+    return -1;
+  }
+  first = from;
+  last = to;
+  return count;
+}
+
+bool Vim::onCommand(std::string cmd)
+{
+  bool ret=true;
+  vdebug("EXEC", cmd << "   ");
+  WindowBuffer *wbuff = getWBuff(curwid);
+  if (cmd == "set" or cmd.compare(0, 4, "set ") == 0 or cmd.compare(0, 9, "setlocal ") == 0)
+  {
+    bool local_only = cmd[3] == 'l';
+    settings_changed = false;
+    ret = cmd.length() > 3 ? set(cmd.c_str()+(local_only ? 9 : 4), local_only) : true;
+    if (cmd.length() == 3) showSettings(false);
+    if (settings_changed)
+    {
+      validateCursors();
+      redraw();
+    }
+    return ret;
+  }
+  if (cmd == "mkvimrc")
+  {
+    if (not saveRc()) error("Unable to write .vimrc");
+    return true;
+  }
+  if (cmd == "packinfo")
+  {
+    if (wbuff) message(wbuff->buffer().packInfo());
+    return true;
+  }
+  if (cmd == "follow" or cmd == "nofollow")
+  {
+    if (wbuff and wbuff->buffer().follow(cmd[0] == 'f')) return true;
+    error("Not a view (-R)");
+    return false;
+  }
+  if (cmd.compare(0, 5, "view ") == 0)
+  {
+    string file = cmd.substr(5);
+    trim(file);
+    return view(getFile(env.cwd, file), Buffer::VIEW);
+  }
+  if (cmd == "hex" or cmd.compare(0, 4, "hex ") == 0)
+  {
+    // :hex toggles the hex view of the current file
+    string file = cmd.substr(3);
+    trim(file);
+    if (file.length()) return view(getFile(env.cwd, file), Buffer::HEX);
+    if (wbuff == nullptr or wbuff->buffer().filename().empty()) return false;
+    file = wbuff->buffer().filename();
+    auto it = buffers.find(file);
+    if (wbuff->buffer().hex() and it != buffers.end())
+    {
+      showBuffer(*it->second);
+      return true;
+    }
+    if (wbuff->buffer().modified()) error("Changes not saved are not shown");
+    return view(file, Buffer::HEX);
+  }
+  Cursor::type first = 0;
+  Cursor::type last = 0;
+  int8_t range = 0;
+  if (wbuff)
+  {
+    range = getRange(cmd, wbuff->buffer(), wbuff->buffCursor().row, first, last);
+    if (range < 0) return false;
+    trim(cmd);
+    Window win;
+    if (range and cmd.empty() and calcWindow(curwid, win))
+    {
+      // :N goes to the line
+      wbuff->jumpTo(Cursor(last, firstNonBlank(wbuff->buffer().getLine(last))), win, *this);
+      return true;
+    }
+  }
+  while(cmd.length())
+  {
+    char c=getChar(cmd);
+    bool force=cmd[0]=='!';
+    if (force) cmd.erase(0,1);
+    bool ok=false;
+    Term << "EVAL CMD " << (c ? (char)c : '?') << endl;
+    switch (c)
+    {
+      case 'w':
+      case 'x':
+      {
+        string file = getWord(cmd);
+        if (wbuff and save(wbuff->buffer(), getFile(env.cwd, file), force, c=='x'))
+          ok = true;
+        break;
+      }
+      case 'q':
+        quit();
+        return true;
+      case 'd':
+      case 'y':
+      {
+        if (wbuff == nullptr) break;
+        Buffer& buff = wbuff->buffer();
+        if (c == 'd' and not editable(buff)) return false;
+        if (range == 0) first = last = wbuff->buffCursor().row;
+        string lines;
+        for(Cursor::type row = first; row <= last; row++) lines += buff.getLine(row) + '\r';
+        clip(lines);
+        if (c == 'd')
+        {
+          buff.deleteLines(first, last);
+          Window win;
+          wbuff->gotoxy(std::min(first, buff.lines()), 1);
+          if (calcWindow(curwid, win)) wbuff->validateCursor(win, *this);
+        }
+        return true;
+      }
+      case 'k':
+        // :k{a-z} marks the last line of the range
+        if (wbuff and cmd.length())
+        {
+          Cursor::type row = range ? last : wbuff->buffCursor().row;
+          wbuff->buffer().setMark(getChar(cmd), Cursor(row, 1));
+          ok = true;
+        }
+        break;
+    }
+    Term << "RAN " << c << " res=" << ok << endl;
+    ret &= ok;
+    if (not ok)
+      error("Error in command");
+  }
+  vdebug("EXEC", "end exec, ret=" << ret);
+  return ret;
+}
+
+bool Vim::set(const char* args, bool local_only)
+{
+  WindowBuffer* wbuff = getWBuff(curwid);
+  Buffer* buff = wbuff ? &wbuff->buffer() : nullptr;
+  bool ok = true;
+  while(*args)
+  {
+    while(*args == ' ') args++;
+    const char* arg = args;
+    while(*args and *args != ' ') args++;
+    size_t len = args-arg;
+    if (len == 0) break;
+    if (len == 3 and strncmp(arg, "all", 3) == 0)
+      showSettings(true);
+    else if (not setOne(arg, len, buff, local_only))
+      ok = false;
+  }
+  if (buff) buff->applySettings();
+  return ok;
+}
+
+bool Vim::setOne(const char* arg, size_t len, Buffer* buff, bool local_only)
+{
+  char op = 0;  // '=', '?', '!' (toggle), '0' (reset) or 0 (set or show)
+  const char* value = nullptr;
+  size_t name_len = len;
+  const char* eq = (const char*)memchr(arg, '=', len);
+  if (eq)
+  {
+    op = '=';
+    name_len = eq-arg;
+    value = eq+1;
+  }
+  else if (arg[len-1] == '?' or arg[len-1] == '!')
+    op = arg[--name_len];
+  const VimSettings::Decl* decl = VimSettings::find(arg, name_len);
+  if (decl == nullptr and op == 0 and strncmp(arg, "no", 2) == 0)
+  {
+    decl = VimSettings::find(arg+2, name_len-2);
+    op = '0';
+  }
+  if (decl == nullptr and op == 0 and strncmp(arg, "inv", 3) == 0)
+  {
+    decl = VimSettings::find(arg+3, name_len-3);
+    op = '!';
+  }
+  if (decl == nullptr)
+  {
+    error("Unknown option");
+    return false;
+  }
+  // :set changes the global and the buffer values, :setlocal the buffer one
+  VimSettings* local = (buff and decl->scope == VimSettings::BUFFER) ? &buff->local : nullptr;
+  VimSettings& shown = local ? *local : settings;
+  bool boolean = decl->type == VimSettings::BOOLEAN;
+  if (op == '?' or (op == 0 and not boolean))
+  {
+    char out[32];
+    shown.print(*decl, out, sizeof(out));
+    message(out);
+    return true;
+  }
+  if (boolean == (op == '='))
+  {
+    error("Invalid argument");
+    return false;
+  }
+  bool ok = true;
+  settings_changed = true;
+  for(VimSettings* target: { local_only ? nullptr : &settings, local })
+  {
+    if (target == nullptr) continue;
+    if (op == '=')
+      ok &= target->assign(*decl, value, len-(value-arg));
+    else
+      target->*decl->number = op == '!' ? not (shown.*decl->number) : op != '0';
+  }
+  if (not ok) error("Invalid argument");
+  return ok;
+}
+
+void Vim::showSettings(bool all)
+{
+  WindowBuffer* wbuff = getWBuff(curwid);
+  const VimSettings* local = wbuff ? &wbuff->buffer().local : nullptr;
+  std::string list;
+  uint8_t count = 0;
+  for(const VimSettings::Decl* decl = VimSettings::begin(); decl != VimSettings::end(); decl++)
+  {
+    const VimSettings& values = (local and decl->scope == VimSettings::BUFFER) ? *local : settings;
+    if (not all and values.isDefault(*decl)) continue;
+    char out[32];
+    size_t len = values.print(*decl, out, sizeof(out));
+    list.append(out, len).append(20 - std::min<size_t>(len, 19), ' ');
+    count++;
+  }
+  if (list.length() <= term->sx)
+  {
+    message(list);
+    return;
+  }
+  // On the whole screen, until a key is hit
+  uint8_t columns = std::max(term->sx/20, 1);
+  term->clear();
+  for(uint8_t i=0; i<count; i++)
+  {
+    term->gotoxy(i/columns+1, (i%columns)*20+1);
+    *term << list.substr(i*20, 20);
+  }
+  term->gotoxy(term->sy, 1);
+  *term << "Hit a key";
+  waiting_key = true;
+}
+
+static constexpr const char* rc_file = "/.vimrc";
+
+// set lines of the rc file (comments start with ")
+void Vim::loadRc()
+{
+  if (not FILE_SYSTEM.exists(rc_file)) return;
+  File file = FILE_SYSTEM.open(rc_file, "r");
+  if (not file) return;
+  char line[80];
+  uint8_t len = 0;
+  bool more = true;
+  while(more)
+  {
+    more = file.available();
+    char c = more ? file.read() : '\n';
+    if (c != '\n' and c != '\r')
+    {
+      if (len < sizeof(line)-1) line[len++] = c;
+      continue;
+    }
+    line[len] = 0;
+    const char* args = line;
+    while(*args == ' ') args++;
+    if (strncmp(args, "set ", 4) == 0) set(args+4);
+    len = 0;
+  }
+}
+
+// Settings that are not the default ones
+bool Vim::saveRc()
+{
+  File file = FILE_SYSTEM.open(rc_file, "w");
+  if (not file) return false;
+  for(const VimSettings::Decl* decl = VimSettings::begin(); decl != VimSettings::end(); decl++)
+  {
+    if (settings.isDefault(*decl)) continue;
+    char out[32];
+    size_t len = settings.print(*decl, out, sizeof(out));
+    file.write((const uint8_t*)"set ", 4);
+    file.write((const uint8_t*)out, len);
+    file.write((const uint8_t*)"\n", 1);
+  }
+  file.close();
+  return true;
+}
+
+void Vim::validateCursors()
+{
+  Window all(1, 1, term->sx, term->sy);
+  splitter.forEachWindow(all, [this](const Window& win, Wid wid, const Splitter*)
+  {
+    WindowBuffer* wbuff = getWBuff(wid);
+    if (wbuff) wbuff->validateCursor(win, *this);
+    return true;
+  });
+}
+
+void Vim::onKey(TinyTerm::KeyCode key)
+{
+  uint32_t now = millis();
+  bool text = key == TinyTerm::KEY_RETURN or key == TinyTerm::KEY_CTRL_I or (key >= ' ' and key < 256 and key != TinyTerm::KEY_BACK);
+  if (text and settings.mode == INSERT and not playing and not bracketed and not literal_next)
+  {
+    if (paste.length() and now-last_key >= paste_gap)
+    {
+      suspendRender();
+      endPaste();
+      resumeRender();
+    }
+    last_key = now;
+    paste += (char)key;
+    return;
+  }
+  last_key = now;
+  suspendRender();
+  endPaste();
+  dispatch(key);
+  resumeRender();
+}
+
+void Vim::endPaste()
+{
+  if (paste.length() != 1) return insertPaste();
+  TinyTerm::KeyCode key = (TinyTerm::KeyCode)(uint8_t)paste[0];
+  paste.clear();
+  dispatch(key);
+}
+
+// The text is inserted as is: no command of the normal mode runs, no
+// autoindent. Other modes (command line, visual...) get it as keys.
+void Vim::endBracketedPaste()
+{
+  pasting = false;
+  string text;  // LF and CR LF become CR, as typed
+  text.reserve(paste.length());
+  for(size_t i=0; i<paste.length(); i++)
+    if (paste[i] != '\n') text += paste[i];
+    else if (i == 0 or paste[i-1] != '\r') text += '\r';
+  paste.clear();
+  suspendRender();
+  if (settings.mode == INSERT or settings.mode == NORMAL)
+  {
+    bool normal = settings.mode == NORMAL;
+    if (normal) dispatch((TinyTerm::KeyCode)'i');
+    paste.swap(text);
+    insertPaste();
+    if (normal) dispatch(TinyTerm::KEY_ESC);
+  }
+  else
+    for(char c: text) dispatch((TinyTerm::KeyCode)(uint8_t)c);
+  resumeRender();
+}
+
+// Link bytes to keys: a lone ESC is the ESC key once esc_delay has passed
+// without the rest of a sequence, BACKSPACE (8) and DEL (127) are KEY_BACK
+void Vim::receive()
+{
+  while(link->available() > 0)
+  {
+    received += (char)link->read();
+    received_at = millis();
+  }
+  size_t i = 0;
+  while(i < received.length() and not quitting)
+  {
+    if (pasting)
+    {
+      // The end marker may not be complete yet, its first bytes wait
+      size_t end = received.find("\033[201~", i);
+      size_t stop = end != string::npos ? end : std::max(i, received.length() >= 5 ? received.length()-5 : 0);
+      paste.append(received, i, stop-i);
+      i = stop;
+      if (end == string::npos) break;
+      i += 6;
+      endBracketedPaste();
+      continue;
+    }
+    uint8_t c = received[i];
+    if (c != TinyTerm::KEY_ESC)
+    {
+      onKey(c == 8 ? TinyTerm::KEY_BACK : (TinyTerm::KeyCode)c);
+      i++;
+      continue;
+    }
+    size_t end = i+1;
+    if (end < received.length() and received[end] == '[')
+      while(++end < received.length() and (received[end] < 0x40 or received[end] > 0x7E));
+    if (end == received.length() and millis()-received_at < esc_delay) break;  // wait for the rest
+    if (end == i+1 or end == received.length())
+    {
+      onKey(TinyTerm::KEY_ESC);
+      i++;
+      continue;
+    }
+    onSequence(received.substr(i+2, end-i-2), received[end]);
+    i = end+1;
+  }
+  received.erase(0, i);
+}
+
+void Vim::onSequence(const string& params, char final)
+{
+  TinyTerm::KeyCode key;
+  switch(final)
+  {
+    case 'A': key = TinyTerm::KEY_UP; break;
+    case 'B': key = TinyTerm::KEY_DOWN; break;
+    case 'C': key = TinyTerm::KEY_RIGHT; break;
+    case 'D': key = TinyTerm::KEY_LEFT; break;
+    case 'H': key = TinyTerm::KEY_HOME; break;
+    case 'F': key = TinyTerm::KEY_END; break;
+    case '~':
+      switch(atoi(params.c_str()))
+      {
+        case 1: case 7: key = TinyTerm::KEY_HOME; break;
+        case 4: case 8: key = TinyTerm::KEY_END; break;
+        case 3: key = TinyTerm::KEY_SUPPR; break;
+        case 5: key = TinyTerm::KEY_CTRL_B; break;  // page up
+        case 6: key = TinyTerm::KEY_CTRL_F; break;  // page down
+        case 200:
+          suspendRender();
+          endPaste();
+          resumeRender();
+          pasting = bracketed = true;
+          return;
+        default: return;
+      }
+      break;
+    default:
+      vdebug("sequence", "ignored ESC [" << params << final);
+      return;
+  }
+  onKey(key);
+}
+
+void Vim::insertPaste()
+{
+  if (paste.empty()) return;
+  string text;
+  text.swap(paste);
+  // Recorded as typed, '.' and macros play the keys again
+  for(char c: text)
+  {
+    TinyTerm::KeyCode key = (TinyTerm::KeyCode)(uint8_t)c;
+    if (macro_reg) recordKey(registers[macro_reg], key);
+    if (changing) recordKey(change.text, key);
+  }
+  WindowBuffer* wbuff = getWBuff(curwid);
+  Window win;
+  if (wbuff and calcWindow(curwid, win)) wbuff->insertText(text, win, *this);
+}
+
+void Vim::dispatch(TinyTerm::KeyCode key)
+{
+  Action cmd = Action::VIM_UNKNOWN;
+  vdebug("vimkey", "key:" << (key>31 and key<128 ? (char)key : ' ') << " (" << (int)key << "), recsize " << record.size() << ", rpt_count=" << rpt_count << ", play=" << playing << ", mode=" << settings.mode << "  ");
+
+  if (waiting_key)
+  {
+    waiting_key = false;
+    redraw();
+    return;
+  }
+  if (macro_reg and not playing) recordKey(registers[macro_reg], key);
+
+  if (literal_next)
+  {
+    literal_next = false;
+    if (changing) recordKey(change.text, key);
+    WindowBuffer* wbuff = getWBuff(curwid);
+    Window win;
+    if (key < 256 and wbuff and calcWindow(curwid, win)) wbuff->insertText(string(1, (char)key), win, *this);
+    return;
+  }
+  if (key == TinyTerm::KEY_ESC)
+  {
+    if (jobs.size() and settings.mode == NORMAL) cancelJobs();
+    endChange();
+    scmd.clear();
+    rpt_count=0;
+    op_count=0;
+    last_was_digit=false;
+    reg_action=Action::VIM_UNKNOWN;
+    setMode(NORMAL);
+    return;
+  }
+  if (changing) recordKey(change.text, key);
+
+  if (reg_action != Action::VIM_UNKNOWN)
+  {
+    Action action = reg_action;
+    reg_action = Action::VIM_UNKNOWN;
+    if (key>=' ' and key<128) onRegister(action, (char)key, reg_count);
+    return;
+  }
+
+  else if (key==TinyTerm::KEY_LEFT) cmd=Action::VIM_MOVE_LEFT;
+  else if (key==TinyTerm::KEY_RIGHT) cmd=Action::VIM_MOVE_RIGHT;
+  else if (key==TinyTerm::KEY_UP) cmd=Action::VIM_MOVE_UP;
+  else if (key==TinyTerm::KEY_DOWN) cmd=Action::VIM_MOVE_DOWN;
+  else if (key==TinyTerm::KEY_CTRL_C)
+  {
+    quit();
+    return;
+  }
+  else if (key==TinyTerm::KEY_CTRL_V)
+  {
+    if (settings.mode == NORMAL or (settings.mode & VISUAL_MODE))
+      toggleMode(VISUAL_BLOCK);
+    else if (settings.mode == INSERT)
+      literal_next = true;
+    return;
+  }
+  else if (settings.mode == NORMAL or (settings.mode & VISUAL_MODE))
+  {
+    if (key==TinyTerm::KEY_CTRL_D) cmd=Action::VIM_HALF_PAGE_DOWN;
+    else if (key==TinyTerm::KEY_CTRL_U) cmd=Action::VIM_HALF_PAGE_UP;
+    else if (key==TinyTerm::KEY_CTRL_F) cmd=Action::VIM_PAGE_DOWN;
+    else if (key==TinyTerm::KEY_CTRL_B) cmd=Action::VIM_PAGE_UP;
+  }
+  Wid wid=settings.mode==COMMAND ? 0x4000 : curwid;
+  WindowBuffer *wbuff = getWBuff(wid);
+  Window win;
+  if (!calcWindow(wid, win))
+  {
+    vdebug("vcalc_win", "bad " << hex(wid));
+    wbuff=nullptr;
+  }
+  else
+    vdebug("vcalc_win", hex(wid) << ", " << win);
+
+  if (key == TinyTerm::KEY_CTRL_L)
+  {
+    redraw();
+    return;
+  }
+
+  if ((key == TinyTerm::KEY_CTRL_O or key == TinyTerm::KEY_CTRL_I) and settings.mode == NORMAL and scmd.empty())
+  {
+    uint32_t count = rpt_count ? rpt_count : 1;
+    rpt_count = 0;
+    last_was_digit = false;
+    if (wbuff == nullptr) return;
+    Cursor pos = wbuff->buffCursor();
+    while(count-- and wbuff->buffer().jump(key == TinyTerm::KEY_CTRL_O ? -1 : 1, pos));
+    wbuff->gotoxy(pos.row, pos.col);
+    wbuff->validateCursor(win, *this);
+    return;
+  }
+
+  if ((key == ':' or key == '/') and settings.mode == NORMAL)
+  {
+    settings.mode = COMMAND;
+    scmd.clear();
+    if (key == '/') scmd += '/';
+    Window cmd_win;
+    if (calcWindow(0x4000, cmd_win))
+    {
+      term->gotoxy(cmd_win.top, cmd_win.left);
+      *term << scmd << string(cmd_win.width-scmd.length(), ' ');
+      term->gotoxy(cmd_win.top, cmd_win.left+scmd.length());
+    }
+    return;
+  }
+  else if (settings.mode == COMMAND)
+  {
+    // NOTE: mode command could be handled by a TinyConsole instance initialized with a virtual TinyTerm:
+    // a term delimited by 0x4000 window.
+    // TODO, WindowBuffer is nearly what is expected, especially clipping region.
+    // WindowBuffer class should be splitted in VirtualTerm handling the window region.
+    switch(key)
+    {
+      case TinyTerm::KEY_RETURN:
+      {
+        settings.mode = NORMAL;
+        vdebug("COMMAND", "EXEC " << scmd);
+        if (scmd[0] == '/')
+          search(scmd.length()>1 ? scmd.substr(1) : search_);
+        else
+          onCommand(scmd);
+        scmd.clear();
+        return;  // keeps the message of the command
+      }
+      case TinyTerm::KEY_BACK:
+        if (scmd.length()) scmd.erase(scmd.length()-1,1);
+        break;
+      default:
+        if (key>=' ' and key<=128)
+          scmd += key;
+        vdebug("COMMAND", scmd << "   ");
+        break;
+    }
+    term->gotoxy(win.top, win.left);
+    *term << scmd << "   ";
+    term->gotoxy(win.top, win.left+scmd.length());
+    return;
+  }
+  
+  bool visual = settings.mode & VISUAL_MODE;
+  if (visual and wbuff and scmd.length()==0 and key<128 and strchr("dxyc<>=~", key))
+  {
+    if (key == 'y')
+      wbuff->onVisual((char)key, win, *this);
+    else if (editable(wbuff->buffer()))
+    {
+      change.count = 0;
+      change.command = wbuff->visualKeys();
+      change.text.clear();
+      recordKey(change.command, key);
+      wbuff->onVisual((char)key, win, *this);
+      if (settings.mode & EDIT_MODE)
+        changing = true;
+      else
+        last_change = change;
+    }
+    return;
+  }
+
+  if (settings.mode == NORMAL or visual or cmd!=Action::VIM_UNKNOWN)
+  {
+    // d3w: the count typed after an operator multiplies the first one
+    bool after_op = scmd.length()==1 and isOperator(scmd[0]) and not visual;
+    if ((settings.mode == NORMAL or visual) and key>='0' and key<='9' and (scmd.length()==0 or after_op)
+        and (key!='0' or last_was_digit))
+    {
+      uint32_t& count = after_op ? op_count : rpt_count;
+      if (not last_was_digit) count=0;
+      count = std::min<uint32_t>(10*count+key-'0', Cursor::lines_max);
+      if (after_op) recordKey(change.command, key);
+      vdebug("rec", count);
+      last_was_digit=true;
+      return;
+    }
+    last_was_digit=false;
+    if ((settings.mode == NORMAL or visual) and key>=' ' and key<256 and key!=':')
+    {
+      if (scmd.length()==0)
+      {
+        change.count = rpt_count;
+        change.command.clear();
+        change.text.clear();
+      }
+      recordKey(change.command, key);
+      scmd += (char)key;
+      if (isOperator(scmd[0]) and not visual)
+      {
+        onOperator();
+        return;
+      }
+      if (visual and (scmd[0] == 'i' or scmd[0] == 'a'))
+      {
+        // v iw, v a{...
+        if (scmd.length() == 1) return;
+        if (wbuff) wbuff->selectObject(scmd.c_str(), rpt_count, win, *this);
+        scmd.clear();
+        rpt_count = 0;
+        return;
+      }
+      cmd = getAction(scmd.c_str());
+      vdebug("scmd", scmd << ", cmd " << (int)cmd);
+      if (cmd == Action::VIM_UNTERMINATED)
+      {
+        vdebug("unterminated", scmd);
+        return;
+      }
+      scmd.clear();
+      uint32_t typed = rpt_count;  // 0 if none
+      uint32_t count = rpt_count ? rpt_count : 1;
+      rpt_count = 0;
+      if (visual and isChange(cmd)) return;
+      if (isChange(cmd) and wbuff and not editable(wbuff->buffer())) return;
+      switch(cmd)
+      {
+        case Action::VIM_INSERT: setMode(INSERT); break;
+        case Action::VIM_REPLACE: setMode(REPLACE); break;
+        case Action::VIM_VISUAL: toggleMode(VISUAL); return;
+        case Action::VIM_VISUAL_LINE: toggleMode(VISUAL_LINE); return;
+        case Action::VIM_SEARCH_NEXT:
+          search(search_);
+          return;
+        case Action::VIM_REPEAT:
+          play(last_change, change.count ? change.count : last_change.count);
+          return;
+        case Action::VIM_RECORD:
+          if (macro_reg)
+          {
+            Record& macro = registers[macro_reg];
+            if (not playing and macro.length()) macro.erase(macro.length()-1); // the q
+            macro_reg = 0;
+            return;
+          }
+          // no break
+        case Action::VIM_PLAY:
+        case Action::VIM_MARK:
+        case Action::VIM_GOTO_MARK_LINE:
+        case Action::VIM_GOTO_MARK:
+        case Action::VIM_FIND:
+        case Action::VIM_TILL:
+        case Action::VIM_FIND_BACK:
+        case Action::VIM_TILL_BACK:
+          reg_action = cmd;
+          reg_count = count;
+          return;
+        case Action::VIM_UNKNOWN:
+          return;
+        default:
+          if (wbuff and wbuff->buffer().loading() and isMotion(cmd))
+          {
+            // Motions past the loaded lines wait for them only
+            int32_t row = wbuff->buffCursor().row + count + win.height;
+            if (cmd == Action::VIM_MOVE_DOC_END or cmd == Action::VIM_MATCH_PAIR or
+                (cmd == Action::VIM_MOVE_DOC_BEGIN and typed) or row > Cursor::lines_max)
+              row = std::numeric_limits<Cursor::type>::max();
+            loadTo(wbuff->buffer(), row);
+          }
+          if (wbuff)
+          {
+            if (isJump(cmd)) wbuff->buffer().pushJump(wbuff->buffCursor());
+            suspendRender();
+            if (isMotion(cmd))
+              wbuff->onAction(cmd, win, *this, typed);
+            else
+              while(count-- and (settings.mode & EDIT_MODE)==0)
+                wbuff->onAction(cmd, win, *this);
+            resumeRender();
+          }
+          break;
+      }
+      if (isChange(cmd))
+      {
+        if (settings.mode & EDIT_MODE)
+          changing = true;
+        else
+          last_change = change;
+      }
+      return;
+    }
+    else if (wbuff and cmd!=Action::VIM_UNKNOWN)
+    {
+      wbuff->onAction(cmd, win, *this, rpt_count);
+      rpt_count = 0;
+    }
+  }
+  else
+  {
+    last_was_digit=false;
+  }
+  if (wbuff) wbuff->onKey(key, win, *this);
+}
+
+// scmd is an operator followed by a motion, a text object or the
+// operator again (dd), waits for the next key until it is complete
+void Vim::onOperator()
+{
+  char op = scmd[0];
+  const char* object = scmd.c_str()+1;
+  Action motion = Action::VIM_UNKNOWN;
+  bool text_object = false;
+  if (*object == 0) return;
+  if (object[0] == op and object[1] == 0)
+    ;
+  else if (object[0] == 'i' or object[0] == 'a')
+  {
+    if (object[1] == 0) return;
+    text_object = true;
+  }
+  else if (strchr("fFtT", object[0]))
+  {
+    if (object[1] == 0) return;
+    motion = getAction(string(1, object[0]).c_str());
+    last_find = { motion, object[1] };
+  }
+  else
+  {
+    motion = getAction(object);
+    if (motion == Action::VIM_UNTERMINATED) return;
+    if (not isMotion(motion))
+    {
+      scmd.clear();
+      rpt_count = op_count = 0;
+      return;
+    }
+  }
+  uint32_t typed = rpt_count or op_count ?
+    std::min<uint64_t>((uint64_t)std::max<uint32_t>(rpt_count, 1)*std::max<uint32_t>(op_count, 1), Cursor::lines_max) : 0;
+  rpt_count = op_count = 0;
+  string object_keys(text_object ? object : "");
+  scmd.clear();
+  WindowBuffer* wbuff = getWBuff(curwid);
+  Window win;
+  if (wbuff == nullptr or not calcWindow(curwid, win)) return;
+  if (op != 'y' and not editable(wbuff->buffer())) return;
+  if (wbuff->buffer().loading())
+  {
+    int32_t row = wbuff->buffCursor().row + std::max<uint32_t>(typed, 1) + win.height;
+    if (text_object or motion == Action::VIM_MOVE_DOC_END or motion == Action::VIM_MATCH_PAIR or
+        row > Cursor::lines_max)
+      row = std::numeric_limits<Cursor::type>::max();
+    loadTo(wbuff->buffer(), row);
+  }
+  wbuff->onOperator(op, motion, text_object ? object_keys.c_str() : nullptr, typed, win, *this);
+  if (op == 'y') return;
+  if (settings.mode & EDIT_MODE)
+    changing = true;
+  else
+    last_change = change;
+}
+
+void Vim::onMouse(const TinyTerm::MouseEvent& e)
+{
+}
+
+Splitter::Splitter(bool vertical, uint16_t size)
+  : side_1(nullptr), side_0(nullptr)
+{
+  split_.vertical = vertical;
+  split_.size = size;
+}
+
+Splitter::~Splitter()
+{
+  delete side_1;
+  delete side_0;
+}
+
+Splitter* Splitter::split(Wid wid, char v_h, uint16_t size)
+{
+  bool vertical = v_h == 'v';
+  bool side_1;
+  Splitter* sthis=this;
+  Splitter** splitter=&sthis;
+  while((wid & 0x7FFF) and *splitter)
+  {
+    side_1 = wid & 0x8000;
+    if (side_1) splitter=&((*splitter)->side_1);
+    else splitter = &((*splitter)->side_0);
+    wid <<=1;
+  }
+  if (*splitter==this) return nullptr;
+  if (*splitter)
+    (*splitter)->split_.size = size;
+  *splitter = new Splitter(vertical, size);
+  return *splitter;
+}
+
+void Window::calcSplitWids(Wid wid, Wid& wid_0, Wid& wid_1)
+{
+  Wid win_bit = wid-(wid & (wid-1)); // (last bit of cur_wid)
+  wid |= win_bit>>1;
+  wid_0 = wid & ~win_bit;
+  wid_1 = wid;
+}
+
+void Splitter::draw(Window win, TinyTerm& term, Wid wid)
+{
+  Wid wid_0;
+  Wid wid_1;
+  Window::calcSplitWids(wid, wid_0, wid_1);
+  TypeSize& split = split_;
+  #if 0
+  auto printWid = [](const Window& win, Wid wid){};
+  #else
+  auto printWid = [&term](const Window& win, Wid wid)
+  {
+      term.gotoxy(win.top+win.height/2,win.left+win.width/2-4);
+      term << ' ' << hex(wid) << ' ';
+      term.gotoxy(win.top+win.height/2+1,win.left+win.width/2-6);
+      term << ' ' << win << ' ';
+  };
+  #endif
+  if (split.vertical)
+  {
+    term.gotoxy(win.top, win.left+split.size);
+    for(int i=win.top; i < win.top+win.height; i++)
+    {
+      term << "\u2502\033[1B\033[1D";
+    }
+
+    Window w1(win.top, win.left, split.size, win.height);
+    if (side_1) side_1->draw(w1, term, wid_1);
+    else printWid(w1, wid_1);
+
+    win.left += split.size + 1;
+    win.width += split.size - 1;
+    if (side_0) side_0->draw(win, term, wid_0);
+    else printWid(win, wid_0);
+  }
+  else
+  {
+    term.gotoxy(win.top+split.size, win.left);
+    for(int i=0; i < win.width; i++) term << "\u2500";
+
+    Window w1(win.top, win.left, win.width, split.size);
+    if (side_1) side_1->draw(w1, term, wid_1);
+    else printWid(w1, wid_1);
+
+    win.height += - split.size - 1;
+    win.top += split.size+1;
+    if (side_0) side_0->draw(win, term, wid_0);
+    else printWid(win, wid_0);
+  }
+}
+
+void Splitter::dump2(Window from)
+{
+  forEachWindow(from,
+    [](const Window& win, Wid wid, const Splitter* splitter) -> bool
+    {
+      Term << wid << ' ' << win << endl;
+      return true;
+    }
+  );
+}
+
+bool Splitter::forEachWindow(Window& from,
+  std::function<bool(const Window& win, Wid wid, const Splitter* cur_split)> fun,
+  Wid wid)
+{
+  Wid wid_0;
+  Wid wid_1;
+  Window::calcSplitWids(wid, wid_0, wid_1);
+  TypeSize& split = split_;
+  Window win = from;
+  if (split.vertical)
+  {
+    win.width = split.size;
+    if (side_1)
+    {
+      if (not side_1->forEachWindow(win, fun, wid_1)) return false;
+    }
+    else if (not fun(win, wid_1, this)) return false;
+
+    win.left = from.left+split.size+1;
+    win.width = from.width-split.size - 1;
+    if (side_0)
+    {
+      if (not side_0->forEachWindow(win, fun, wid_0)) return false;
+    }
+    else if (not fun(win, wid_0, this)) return false;
+  }
+  else
+  {
+    win.height = split.size;
+    if (side_1)
+    {
+      if (not side_1->forEachWindow(win, fun, wid_1)) return false;
+    }
+    else if (not fun(win, wid_1, this)) return false;
+
+    win.height = from.height - split.size - 1;
+    win.top = from.top + split.size+1;
+    if (side_0)
+    {
+      if (not side_0->forEachWindow(win, fun, wid_0)) return false;
+    }
+    else if (not fun(win, wid_0, this)) return false;
+  }
+  return true;
+}
+
+bool Splitter::calcWindow(Wid wid, Window& win, Splitter* splitter)
+{
+  splitter = this;
+  while((wid & 0x7FFF) and splitter)
+  {
+    TypeSize& split = splitter->split_;
+    bool side_1 = wid & 0x8000;
+    if (split.vertical) {
+      if (side_1) { win.width = split.size; }
+      else { win.left += split.size+1; win.width -= (split.size+1); }
+    }
+    else {
+      if (side_1) { win.height = split.size; }
+      else { win.top += split.size+1; win.height -= (split.size+1); }
+    };
+    if (side_1)
+      splitter=splitter->side_1;
+    else
+      splitter=splitter->side_0;
+    wid <<= 1;
+  }
+  while(splitter)
+  {
+    vdebug("split", "should not be here " << hex(wid));
+    if (splitter->split_.vertical)
+      win.width = splitter->split_.size;
+    else
+      win.height = splitter->split_.size;
+    splitter = splitter->side_1;
+  }
+  return wid==0x8000;
+}
+
+void Splitter::close(Wid)
+{
+}
+
+Wid Splitter::findWindow(Window& term, const Cursor& point)
+{
+  Wid win=0;
+  forEachWindow(term,
+    [&point,&win](const Window& candidate, Wid wid, const Splitter* splitter) -> bool
+    {
+      if (candidate.isInside(point))
+      {
+        win = wid;
+        return false; // exit forEachWindow
+      }
+      return true;  // continue
+    }
+  );
+  return win;
+}
+
+void Splitter::dump(Window from, string indent, Wid cur_wid)
+{
+  Wid win_bit = cur_wid-(cur_wid & (cur_wid-1)); // (last bit of cur_wid)
+  cur_wid |= win_bit>>1;
+  Wid wid_0 = cur_wid & ~win_bit;
+  Wid wid_1 = cur_wid;
+  indent += "  ";
+  Term << indent << "dump from ";
+  Term << from << ' ' << (split_.vertical ? 'V' : 'H') << split_.size << endl;
+
+  Window s1(from);
+  if (split_.vertical)
+  {
+    s1.left += split_.size;
+    s1.width -= split_.size+1;
+  }
+  else
+  {
+    s1.height = split_.size+1;
+  }
+
+  if (side_1)
+  {
+   Term << indent << "side_1:" << endl;
+    side_1->dump(s1, indent, wid_1);
+  }
+  else
+    Term << indent <<  "wid_1:" << hex(wid_1) << ' ' << s1 << endl;
+
+  if (split_.vertical)
+  {
+    from.width = split_.size;
+  }
+  else
+  {
+    from.top += split_.size+1;
+    from.height -= split_.size+1;
+  }
+  if (side_0)
+  {
+    Term << indent << "side_0:" << endl;
+    side_0->dump(from, indent, wid_0);
+  }
+  else
+    Term << indent << "wid_0:" << hex(wid_0) << ' ' << from << endl;
+}
+
+void WindowBuffer::status(const Window& win, TinyTerm& term)
+{
+  uint16_t title_row = win.top+win.height;
+  if (title_row <= term.sy)
+  {
+    std::string title = buff.filename();
+    if (buff.readOnly()) title += buff.hex() ? " [hex]" : " [RO]";
+    title += buff.modified() ? '*' : ' ';
+    int16_t col=win.left+win.width-1-title.length();
+    while (col<win.left) { title.erase(0,1); col++; }
+    term.gotoxy(title_row, win.left+1);
+    term << ' ' << cursor.row << ' ' << buff.displayCol(cursor.row, cursor.col-1)+1 << "  ";
+    if (title == title_shown) return;
+    term.gotoxy(title_row, col);
+    term << title;
+    title_shown = title;
+  }
+}
+
+// Print s[from, to[ with tabs expanded. col is the display column of s[from]
+// (updated), cells before column skip are not printed (a tab cut on the left)
+static void printCells(TinyTerm& term, const string& s, size_t from, size_t to,
+  uint16_t& col, uint16_t skip, uint8_t ts)
+{
+  while(from < to)
+  {
+    // tabs and control chars (never sent to the terminal) are expanded
+    size_t tab = from;
+    while(tab < to and not isControl(s[tab])) tab++;
+    static_cast<Print&>(term).write((const uint8_t*)s.data()+from, tab-from);
+    for(; from < tab; from++) if (not isUtf8Cont(s[from])) col++;
+    if (tab == to) break;
+    uint16_t width = charWidth(s[tab], col, ts);
+    uint16_t hidden = col < skip ? std::min<uint16_t>(skip-col, width) : 0;
+    if (s[tab] == '\t')
+      term << string(width-hidden, ' ');
+    else
+    {
+      string cells{'^', (char)(s[tab] ^ 64)};
+      term << cells.substr(hidden);
+    }
+    col += width;
+    from++;
+  }
+}
+
+// Print s (line from byte offset, display column col) colored by spans, with
+// [sel_from, sel_to[ in reverse video. Attributes are only sent at token boundaries.
+static void printRow(TinyTerm& term, const string& s, size_t offset, uint16_t col, uint16_t skip,
+  uint8_t ts, const Spans& spans, size_t sel_from, size_t sel_to)
+{
+  uint8_t color = TOK_NORMAL;
+  uint8_t token = TOK_NORMAL;
+  bool reverse = false;
+  size_t span = 0;
+  size_t i = 0;
+  while(i < s.length())
+  {
+    while(span < spans.size() and spans[span].first <= offset+i) token = spans[span++].second;
+    size_t end = s.length();
+    if (span < spans.size()) end = std::min(end, spans[span].first-offset);
+    bool selected = i >= sel_from and i < sel_to;
+    end = std::min(end, selected ? sel_to : (i < sel_from ? sel_from : end));
+    if (token != color) { term << token_colors[token]; color = token; }
+    if (selected != reverse) { term << (selected ? reverse_video : normal_video); reverse = selected; }
+    printCells(term, s, i, end, col, skip, ts);
+    i = end;
+  }
+  if (reverse) term << normal_video;
+  if (color != TOK_NORMAL) term << token_colors[TOK_NORMAL];
+}
+
+void WindowBuffer::draw(const Window& area, TinyTerm& term, Cursor::type first, Cursor::type last)
+{
+  static Spans spans;
+  if (first==0) gutter = gutterWidth();  // lines() may have crossed a power of ten
+  Window win = textArea(area);
+  if (first==0)
+  {
+    first = 1;
+    last = std::numeric_limits<Cursor::type>::max();
+    dirty.clear();
+    dirty_all = false;
+    version = buff.version();
+    title_shown.clear();
+  }
+  else if (last==0) last=first;
+  if (last < pos.row) return;
+  term << TinyTerm::hide_cur << TinyTerm::save_cursor;
+  Cursor::type nr = pos.row;
+  uint16_t sub = wrap ? pos_sub : 0;   // screen row of nr (soft wrap)
+  for(int16_t row=0; row < win.height and nr <= last; row++)
+  {
+    const string& line=buff.getLine(nr);
+    // visible bytes [start, end[ from display column skip
+    uint16_t skip = pos.col-1;
+    size_t start, end;
+    size_t subs = 1;
+    if (wrap and nr <= buff.lines())
+    {
+      const std::vector<size_t>& starts = wrapsOf(nr, win.width);
+      subs = starts.size();
+      skip = sub*win.width;
+      start = starts[sub];
+      end = sub+1u < subs ? starts[sub+1] : line.length();
+    }
+    else
+    {
+      start = buff.byteAt(nr, skip);
+      end = buff.byteAt(nr, skip+win.width);
+    }
+    if (nr >= first)
+    {
+      term.gotoxy(win.top+row, area.left);
+      if (gutter) printNumber(term, nr, sub);
+      string s;
+      if (start < line.length())
+        s = line.substr(start, end-start);
+      uint16_t col = buff.displayCol(nr, start);
+      int16_t width = buff.displayCol(nr, start+s.length())-skip;
+      int16_t from=0, to=0;
+      if (vmode and selection(nr, from, to))
+      {
+        // selected bytes, relative to s
+        from = std::max(from-1-(int)start, 0);
+        to = std::min(to-(int)start, (int)s.length());
+        if (from > to) from = to;
+      }
+      spans.clear();
+      if (buff.syntax() and s.length())
+        lexLine(*buff.syntax(), line, buff.syntaxState(nr), &spans);
+      if (nr > buff.lines()) { s="~"; width=1; col=skip; }
+      printRow(term, s, start, col, skip, buff.tabStop(), spans, from, to);
+      if (win.width>width)
+        term << string(win.width-width, ' ');
+      yield();
+    }
+    if (++sub >= subs) { sub = 0; nr++; }
+  }
+  term << TinyTerm::restore_cursor << TinyTerm::show_cur;
+}
+
+void WindowBuffer::visual(uint8_t mode, const Window& win)
+{
+  Cursor cur = buffCursor();
+  if (vmode)
+    invalidate(win, std::min(vstart.row, cur.row), std::max(vstart.row, cur.row));
+  else
+    vstart = cur;
+  vmode = mode;
+  invalidate(win, cur.row);
+}
+
+bool WindowBuffer::selection(Cursor::type row, Cursor::col_type& from, Cursor::col_type& to) const
+{
+  Cursor first = vstart;
+  Cursor last = buffCursor();
+  if (last.row < first.row or (last.row == first.row and last.col < first.col))
+    std::swap(first, last);
+  if (row < first.row or row > last.row) return false;
+  from = 1;
+  to = std::numeric_limits<Cursor::col_type>::max();
+  if (vmode == Vim::VISUAL_BLOCK)
+  {
+    // the block is made of display columns
+    uint16_t c1 = buff.displayCol(vstart.row, vstart.col-1);
+    uint16_t c2 = buff.displayCol(cursor.row, cursor.col-1);
+    if (c1 > c2) std::swap(c1, c2);
+    from = buff.byteAt(row, c1)+1;
+    to = buff.byteAt(row, c2+1);
+  }
+  else if (vmode == Vim::VISUAL)
+  {
+    if (row == first.row) from = first.col;
+    if (row == last.row) to = nextChar(buff.getLine(row), last.col-1);
+  }
+  return true;
+}
+
+// As Vim, '.' applies a visual operator to as many lines from the cursor,
+// and to as many chars (one line) or columns (block), or up to the same
+// char of the last line
+string WindowBuffer::visualKeys() const
+{
+  Cursor first = vstart;
+  Cursor last = buffCursor();
+  if (last.row < first.row or (last.row == first.row and last.col < first.col))
+    std::swap(first, last);
+  auto chars = [this](Cursor::type row, Cursor::col_type from, Cursor::col_type to)
+  {
+    const string& line = buff.getLine(row);
+    uint32_t count = 0;
+    for(size_t i=from-1; i+1<(size_t)to and i<line.length(); i=nextChar(line, i)) count++;
+    return count;
+  };
+  string keys(1, vmode == Vim::VISUAL_LINE ? 'V' : vmode == Vim::VISUAL ? 'v' : (char)TinyTerm::KEY_CTRL_V);
+  if (last.row > first.row) keys += std::to_string(last.row-first.row) + 'j';
+  uint32_t right;
+  if (vmode == Vim::VISUAL_BLOCK)
+  {
+    uint16_t c1 = buff.displayCol(vstart.row, vstart.col-1);
+    uint16_t c2 = buff.displayCol(cursor.row, cursor.col-1);
+    right = c1 > c2 ? c1-c2 : c2-c1;
+  }
+  else if (vmode == Vim::VISUAL_LINE)
+    right = 0;
+  else if (last.row == first.row)
+    right = chars(first.row, first.col, last.col);
+  else
+  {
+    keys += '0';
+    right = chars(last.row, 1, last.col);
+  }
+  if (right) keys += std::to_string(right) + 'l';
+  return keys;
+}
+
+// The selection is changed as one range edit of the buffer
+void WindowBuffer::onVisual(char op, const Window& win, Vim& vim)
+{
+  Cursor first = vstart;
+  Cursor last = buffCursor();
+  if (last.row < first.row or (last.row == first.row and last.col < first.col))
+    std::swap(first, last);
+  bool lines = vmode == Vim::VISUAL_LINE;
+  int16_t from, to;
+  selection(first.row, from, to);
+  Cursor dest(first.row, lines ? 1 : from);
+
+  if (op != '<' and op != '>' and op != '=' and op != '~')
+  {
+    string clip;
+    for(Cursor::type row=first.row; row<=last.row; row++)
+    {
+      selection(row, from, to);
+      const string& line = buff.getLine(row);
+      if (from <= (int)line.length()) clip += line.substr(from-1, to-from+1);
+      if (row != last.row or vmode != Vim::VISUAL) clip += '\r';
+    }
+    vim.clip(clip);
+  }
+
+  switch(op)
+  {
+    case 'c':
+    case 'd':
+    case 'x':
+      if (lines)
+      {
+        if (op == 'c')
+        {
+          buff.deleteLines(first.row+1, last.row);
+          buff.takeLine(first.row).clear();
+        }
+        else
+          buff.deleteLines(first.row, last.row);
+      }
+      else if (vmode == Vim::VISUAL_BLOCK)
+      {
+        for(Cursor::type row=first.row; row<=last.row; row++)
+        {
+          selection(row, from, to);
+          if (from <= (int)buff.getLine(row).length())
+            buff.takeLine(row).erase(from-1, to-from+1);
+        }
+      }
+      else
+      {
+        string tail = buff.getLine(last.row);
+        selection(last.row, from, to);
+        tail.erase(0, std::min((size_t)to, tail.length()));
+        string& line = buff.takeLine(first.row);
+        if (first.col <= (int)line.length()) line.erase(first.col-1);
+        line += tail;
+        buff.deleteLines(first.row+1, last.row);
+      }
+      break;
+    case '<':
+    case '>':
+    case '=':
+      buff.indentLines(first.row, last.row, op);
+      break;
+    case '~':
+      for(Cursor::type row=first.row; row<=last.row; row++)
+      {
+        selection(row, from, to);
+        if (from > (int)buff.getLine(row).length()) continue;
+        string& line = buff.takeLine(row);
+        for(int16_t col=from-1; col<to and col<(int)line.length(); col++)
+          if ((line[col] & 0x80) == 0)
+            line[col] = isupper(line[col]) ? tolower(line[col]) : toupper(line[col]);
+      }
+      break;
+  }
+  vim.setMode(op == 'c' ? Vim::INSERT : Vim::NORMAL);
+  cursor = dest;
+  validateCursor(win, vim);
+}
+
+void WindowBuffer::invalidate(const Window& win, Cursor::type first, Cursor::type last)
+{
+  if (last < first) last = first;
+  if (first < pos.row) first = pos.row;
+  if (last >= pos.row+win.height) last = pos.row+win.height-1;
+  while(first <= last) dirty.insert(first++);
+}
+
+uint8_t Buffer::numberDigits() const
+{
+  if (lines() < digits_min or lines() > digits_max)
+  {
+    digits = 1;
+    digits_min = 0;
+    digits_max = 9;
+    while(lines() > digits_max)
+    {
+      digits++;
+      digits_min = digits_max+1;
+      digits_max = digits_max*10+9;
+    }
+  }
+  return digits;
+}
+
+Window WindowBuffer::textArea(const Window& win) const
+{
+  return Window(win.top, win.left+gutter, win.width-gutter, win.height);
+}
+
+uint8_t WindowBuffer::gutterWidth() const
+{
+  if (not number and not relnumber) return 0;
+  return std::max<uint8_t>(buff.numberDigits(), 3) + 1;
+}
+
+void WindowBuffer::printNumber(TinyTerm& term, Cursor::type row, bool wrapped)
+{
+  string num;
+  if (not wrapped and row <= buff.lines())
+  {
+    Cursor::type n = row;
+    if (relnumber and (row != cursor.row or not number)) n = std::abs(row-cursor.row);
+    num = std::to_string(n);
+  }
+  term << gutter_color << string(std::max<int>(gutter-1-(int)num.length(), 0), ' ') << num << ' ' << token_colors[TOK_NORMAL];
+}
+
+// Only the numbers, when the relative numbers change
+void WindowBuffer::drawGutter(const Window& win, TinyTerm& term)
+{
+  term << TinyTerm::hide_cur << TinyTerm::save_cursor;
+  Cursor::type nr = pos.row;
+  uint16_t sub = wrap ? pos_sub : 0;
+  for(int16_t row=0; row < win.height and nr <= buff.lines(); row++)
+  {
+    size_t subs = wrap ? wrapsOf(nr, win.width).size() : 1;
+    term.gotoxy(win.top+row, win.left-gutter);
+    printNumber(term, nr, sub);
+    if (++sub >= subs) { sub = 0; nr++; }
+  }
+  term << TinyTerm::restore_cursor << TinyTerm::show_cur;
+}
+
+Cursor WindowBuffer::screenCursor(const Window& win)
+{
+  uint16_t col = buff.displayCol(cursor.row, cursor.col-1);
+  if (wrap)
+    return Cursor(screenRow(win, win.height)+1, col % win.width + 1);
+  return Cursor(cursor.row-pos.row+1, col-pos.col+2);
+}
+
+// Visual lines breaks of row, computed once (with the column index,
+// each break costs a few bytes scan, not the whole line)
+const std::vector<size_t>& WindowBuffer::wrapsOf(Cursor::type row, uint16_t width)
+{
+  syncWraps(width);
+  auto it = wraps.find(row);
+  if (it != wraps.end()) return it->second;
+  if (wraps.size() >= max_wraps)
+  {
+    wraps.clear();
+    dirty_all = true;
+  }
+  std::vector<size_t>& starts = wraps[row];
+  starts.push_back(0);
+  uint16_t total = buff.displayWidth(row);
+  for(uint32_t col = width; col < total; col += width)
+    starts.push_back(buff.byteAt(row, col));
+  return starts;
+}
+
+// Forget the wraps of changed rows, and notice when the height of
+// a row changes (rows below have to be drawn again)
+void WindowBuffer::syncWraps(uint16_t width)
+{
+  if (width != wrap_width)
+  {
+    wraps.clear();
+    wrap_width = width;
+  }
+  if (wrap_version == buff.version()) return;
+  if (not buff.changes(wrap_version, [this](Cursor::type first, Cursor::type last)
+  {
+    auto it = wraps.lower_bound(first);
+    while(it != wraps.end() and it->first <= last)
+    {
+      size_t height = it->second.size();
+      Cursor::type row = it->first;
+      it = wraps.erase(it);
+      uint16_t total = buff.displayWidth(row);
+      if (height != (total ? (total+wrap_width-1u)/wrap_width : 1u))
+        if (wrap_shift == 0 or row < wrap_shift) wrap_shift = row;
+    }
+  }))
+  {
+    wraps.clear();
+    wrap_shift = 1;
+  }
+  wrap_version = buff.version();
+}
+
+// Screen row (0 based) of the cursor, -1 if above the window
+// or limit if below. Only the rows on the way are walked.
+int16_t WindowBuffer::screenRow(const Window& win, int16_t limit)
+{
+  uint16_t sub = buff.displayCol(cursor.row, cursor.col-1) / win.width;
+  if (cursor.row < pos.row or (cursor.row == pos.row and sub < pos_sub)) return -1;
+  int32_t row = -pos_sub;
+  for(Cursor::type r = pos.row; r < cursor.row and row < limit; r++)
+    row += wrapsOf(r, win.width).size();
+  return std::min<int32_t>(row + sub, limit);
+}
+
+uint16_t WindowBuffer::scrollUp(uint16_t width, uint16_t rows)
+{
+  uint16_t moved = 0;
+  for(; moved < rows and (pos.row > 1 or pos_sub > 0); moved++)
+  {
+    if (pos_sub)
+      pos_sub--;
+    else
+    {
+      pos.row--;
+      pos_sub = wrapsOf(pos.row, width).size()-1;
+    }
+  }
+  return moved;
+}
+
+void WindowBuffer::scrollDown(uint16_t width, uint16_t rows)
+{
+  while(rows--)
+  {
+    if (pos_sub+1u < wrapsOf(pos.row, width).size())
+      pos_sub++;
+    else if (pos.row < buff.lines())
+    {
+      pos.row++;
+      pos_sub = 0;
+    }
+    else
+      break;
+  }
+}
+
+bool WindowBuffer::move(Action cmd, Cursor& buff_cur, uint32_t count, const Window& area, Vim& vim)
+{
+  uint32_t n = count ? count : 1;
+  std::string_view text = buff.getLine(buff_cur.row);
+  switch(cmd)
+  {
+    case Action::VIM_MOVE_RIGHT:
+    {
+      size_t col = buff_cur.col-1;
+      while(n-- and col < text.length()) col = nextChar(text, col);
+      buff_cur.col = col+1;
+      break;
+    }
+    case Action::VIM_MOVE_LEFT:
+    {
+      size_t col = buff_cur.col-1;
+      while(n-- and col > 0) col = prevChar(text, col);
+      buff_cur.col = col+1;
+      break;
+    }
+    case Action::VIM_MOVE_UP:
+    case Action::VIM_MOVE_DOWN:
+    {
+      // keep the display column
+      uint16_t col = buff.displayCol(buff_cur.row, buff_cur.col-1);
+      int32_t row = buff_cur.row + (cmd == Action::VIM_MOVE_UP ? -(int32_t)n : (int32_t)n);
+      buff_cur.row = std::max<int32_t>(1, std::min<int32_t>(row, buff.lines()));
+      buff_cur.col = buff.byteAt(buff_cur.row, col)+1;
+      break;
+    }
+    case Action::VIM_MOVE_LINE_END:
+      buff_cur.row = std::min<int32_t>(buff_cur.row+(int32_t)n-1, buff.lines());
+      text = buff.getLine(buff_cur.row);
+      buff_cur.col = prevChar(text, text.length())+1;
+      break;
+    case Action::VIM_MOVE_LINE_BEGIN: buff_cur.col=1; break;
+    case Action::VIM_MOVE_DOC_BEGIN:
+    case Action::VIM_MOVE_DOC_END:
+      buff_cur.row = count ? std::min<Cursor::type>(count, buff.lines())
+                           : cmd == Action::VIM_MOVE_DOC_END ? buff.lines() : 1;
+      buff_cur.col = firstNonBlank(buff.getLine(buff_cur.row));
+      break;
+    case Action::VIM_NEXT_WORD:
+    case Action::VIM_NEXT_BIGWORD:
+      buff_cur = wordForward(buff, buff_cur, n, cmd == Action::VIM_NEXT_BIGWORD);
+      break;
+    case Action::VIM_PREV_WORD:
+    case Action::VIM_PREV_BIGWORD:
+      buff_cur = wordBackward(buff, buff_cur, n, cmd == Action::VIM_PREV_BIGWORD);
+      break;
+    case Action::VIM_WORD_END:
+    case Action::VIM_BIGWORD_END:
+      buff_cur = wordEnd(buff, buff_cur, n, cmd == Action::VIM_BIGWORD_END);
+      break;
+    case Action::VIM_FIND:
+    case Action::VIM_TILL:
+    case Action::VIM_FIND_BACK:
+    case Action::VIM_TILL_BACK:
+    case Action::VIM_FIND_REPEAT:
+    case Action::VIM_FIND_REVERSE:
+    {
+      const Vim::Find& find = vim.last_find;
+      bool again = cmd == Action::VIM_FIND_REPEAT or cmd == Action::VIM_FIND_REVERSE;
+      Action action = again ? find.action : cmd;
+      bool forward = action == Action::VIM_FIND or action == Action::VIM_TILL;
+      if (cmd == Action::VIM_FIND_REVERSE) forward = not forward;
+      bool till = action == Action::VIM_TILL or action == Action::VIM_TILL_BACK;
+      size_t col = buff_cur.col-1;
+      if (find.c and findInLine(text, col, find.c, forward, till, again, n))
+        buff_cur.col = col+1;
+      break;
+    }
+    case Action::VIM_MATCH_PAIR:
+      if (count)
+      {
+        // N%: line at N percent of the file
+        buff_cur.row = std::max<int32_t>(1, ((int32_t)std::min<uint32_t>(count, 100)*buff.lines()+99)/100);
+        buff_cur.col = firstNonBlank(buff.getLine(buff_cur.row));
+      }
+      else
+        matchPair(buff, buff_cur);
+      break;
+    case Action::VIM_PREV_PARAGRAPH:
+    case Action::VIM_NEXT_PARAGRAPH:
+    {
+      int8_t dir = cmd == Action::VIM_NEXT_PARAGRAPH ? 1 : -1;
+      buff_cur.row = paragraph(buff, buff_cur.row, n, dir);
+      text = buff.getLine(buff_cur.row);
+      buff_cur.col = dir > 0 and text.length() ? text.length() : 1;
+      break;
+    }
+    case Action::VIM_SCREEN_TOP:
+    case Action::VIM_SCREEN_MIDDLE:
+    case Action::VIM_SCREEN_BOTTOM:
+    {
+      int32_t so = vim.settings.scrolloff;
+      if (so*2 >= area.height) so = (area.height-1)/2;
+      int32_t top = pos.row;
+      int32_t bottom = lastVisibleRow(area);
+      int32_t row = (top+bottom)/2;
+      if (cmd == Action::VIM_SCREEN_TOP)
+      {
+        row = std::min<int32_t>(top+(int32_t)n-1, bottom);
+        if (top > 1) row = std::max(row, std::min(top+so, bottom));
+      }
+      else if (cmd == Action::VIM_SCREEN_BOTTOM)
+      {
+        row = std::max<int32_t>(bottom-(int32_t)n+1, top);
+        if (bottom < buff.lines()) row = std::min(row, std::max(bottom-so, top));
+      }
+      buff_cur.row = row;
+      buff_cur.col = firstNonBlank(buff.getLine(row));
+      break;
+    }
+    case Action::VIM_HALF_PAGE_DOWN:
+    case Action::VIM_HALF_PAGE_UP:
+    {
+      int32_t rows = count ? count : std::max(area.height/2, 1);
+      if (cmd == Action::VIM_HALF_PAGE_UP) rows = -rows;
+      int32_t last_top = std::max(buff.lines()-area.height+1, 1);
+      scrollTo(std::max<int32_t>(1, std::min<int32_t>(pos.row+rows, std::max<int32_t>(last_top, pos.row))));
+      buff_cur.row = std::max<int32_t>(1, std::min<int32_t>(buff_cur.row+rows, buff.lines()));
+      buff_cur.col = firstNonBlank(buff.getLine(buff_cur.row));
+      break;
+    }
+    case Action::VIM_PAGE_DOWN:
+    case Action::VIM_PAGE_UP:
     {
-      if (candidate.isInside(point))
+      int32_t so = vim.settings.scrolloff;
+      if (so*2 >= area.height) so = (area.height-1)/2;
+      int32_t page = std::max(area.height-2, 1);
+      if (cmd == Action::VIM_PAGE_DOWN)
       {
-        win = wid;
-        return false; // exit forEachWindow
+        int32_t top = std::min<int32_t>(pos.row + (int32_t)n*page, std::max<Cursor::type>(buff.lines(), 1));
+        scrollTo(top);
+        buff_cur.row = std::max<int32_t>(buff_cur.row, std::min<int32_t>(top+so, buff.lines()));
       }
-      return true;  // continue
+      else
+      {
+        int32_t top = std::max<int32_t>(pos.row - (int32_t)n*page, 1);
+        scrollTo(top);
+        buff_cur.row = std::min<int32_t>(buff_cur.row, std::max<int32_t>(top+area.height-1-so, 1));
+      }
+      buff_cur.col = firstNonBlank(buff.getLine(buff_cur.row));
+      break;
     }
-  );
-  return win;
+    default:
+      return false;
+  }
+  return true;
 }
 
-void Splitter::dump(Window from, string indent, Wid cur_wid)
+bool WindowBuffer::textObject(const char* object, uint32_t count, Cursor& start, Cursor& end, bool& linewise)
 {
-  Wid win_bit = cur_wid-(cur_wid & (cur_wid-1)); // (last bit of cur_wid)
-  cur_wid |= win_bit>>1;
-  Wid wid_0 = cur_wid & ~win_bit;
-  Wid wid_1 = cur_wid;
-  indent += "  ";
-  Term << indent << "dump from ";
-  Term << from << ' ' << (split_.vertical ? 'V' : 'H') << split_.size << endl;
-
-  Window s1(from);
-  if (split_.vertical)
+  bool around = object[0] == 'a';
+  char kind = object[1];
+  uint32_t n = count ? count : 1;
+  std::string_view text = buff.getLine(cursor.row);
+  size_t col = cursor.col-1;
+  start = end = cursor;
+  linewise = false;
+  auto run = [&text](size_t i, bool big)  // end of the chars of the class of i
   {
-    s1.left += split_.size;
-    s1.width -= split_.size+1;
+    uint8_t cls = charClass(text, i, big);
+    while(i < text.length() and charClass(text, i, big) == cls) i = nextChar(text, i);
+    return i;
+  };
+  switch(kind)
+  {
+    case 'w':
+    case 'W':
+    {
+      bool big = kind == 'W';
+      if (col >= text.length()) return false;
+      uint8_t cls = charClass(text, col, big);
+      size_t first = col;
+      while(first > 0 and charClass(text, prevChar(text, first), big) == cls) first = prevChar(text, first);
+      size_t last = run(col, big);
+      if (around and cls == 0) last = run(last, big);  // the blanks and the word
+      for(uint16_t i=1; i<n; i++) last = run(last, big);
+      if (around and cls)
+      {
+        // trailing blanks, or the leading ones
+        if (last < text.length() and charClass(text, last, big) == 0)
+          last = run(last, big);
+        else
+          while(first > 0 and charClass(text, prevChar(text, first), big) == 0) first = prevChar(text, first);
+      }
+      start.col = first+1;
+      end.col = last+1;
+      return true;
+    }
+    case '"':
+    case '\'':
+    case '`':
+    {
+      // Quotes are paired from the start of the line, \" is not a quote
+      size_t open = std::string_view::npos;
+      size_t close = std::string_view::npos;
+      size_t q = std::string_view::npos;
+      for(size_t i=0; i<text.length(); i++)
+      {
+        if (text[i] == '\\') { i++; continue; }
+        if (text[i] != kind) continue;
+        if (q == std::string_view::npos) { q = i; continue; }
+        if (col <= i)
+        {
+          open = q;
+          close = i;
+          break;
+        }
+        q = std::string_view::npos;
+      }
+      if (open == std::string_view::npos) return false;
+      start.col = open+1;
+      end.col = close+2;
+      if (not around)
+      {
+        start.col++;
+        end.col--;
+      }
+      else if (size_t(end.col-1) < text.length() and charClass(text, end.col-1, false) == 0)
+        end.col = run(end.col-1, false)+1;
+      else
+        while(start.col > 1 and charClass(text, start.col-2, false) == 0) start.col--;
+      return true;
+    }
+    case 'p':
+    {
+      linewise = true;
+      auto blank = [this](Cursor::type row) { return buff.getLine(row).empty(); };
+      Cursor::type last = buff.lines();
+      bool empty = blank(cursor.row);
+      while(start.row > 1 and blank(start.row-1) == empty) start.row--;
+      while(end.row < last and blank(end.row+1) == empty) end.row++;
+      for(uint16_t i = around ? 0 : 1; i<n; i++)
+      {
+        // next run of lines (blank ones for ap)
+        if (end.row == last)
+        {
+          if (around and i == 0)
+            while(start.row > 1 and blank(start.row-1)) start.row--;
+          break;
+        }
+        bool next = blank(end.row+1);
+        while(end.row < last and blank(end.row+1) == next) end.row++;
+      }
+      return true;
+    }
   }
-  else
+  static constexpr const char* brackets = "(){}[]<>";
+  static constexpr const char* aliases = "bB";  // ( and {
+  const char* p = strchr(aliases, kind);
+  if (p) kind = brackets[2*(p-aliases)];
+  p = kind ? strchr(brackets, kind) : nullptr;
+  if (p == nullptr) return false;
+  char open = brackets[(p-brackets) & ~1];
+  char close = brackets[(p-brackets) | 1];
+  Cursor from = cursor;
+  if (col < text.length() and text[col] == open) n--;  // on the open bracket
+  while(n--)
+    if (not buff.findOpen(open, close, from)) return false;
+  Cursor to = from;
+  if (not buff.findClose(open, close, to)) return false;
+  start = from;
+  end = Cursor(to.row, to.col+1);
+  if (around) return true;
+  start.col++;
+  end.col--;
+  // { and } alone on their lines: the lines between them
+  std::string_view first = buff.getLine(from.row);
+  std::string_view last = buff.getLine(to.row);
+  if (size_t(from.col) == first.length() and last.find_first_not_of(" \t") == size_t(to.col-1))
   {
-    s1.height = split_.size+1;
+    if (to.row - from.row < 2) return false;
+    linewise = true;
+    start = Cursor(from.row+1, 1);
+    end = Cursor(to.row-1, 1);
   }
+  return true;
+}
 
-  if (side_1)
+void WindowBuffer::onOperator(char op, Action motion, const char* object, uint32_t count, const Window& win, Vim& vim)
+{
+  Cursor start = cursor;
+  Cursor end = cursor;  // after the last char, or last line if linewise
+  bool linewise = false;
+  if (object)
   {
-   Term << indent << "side_1:" << endl;
-    side_1->dump(s1, indent, wid_1);
+    if (not textObject(object, count, start, end, linewise)) return;
   }
-  else
-    Term << indent <<  "wid_1:" << hex(wid_1) << ' ' << s1 << endl;
-
-  if (split_.vertical)
+  else if (motion == Action::VIM_UNKNOWN)
   {
-    from.width = split_.size;
+    linewise = true;
+    end.row = std::min<int32_t>(cursor.row + (count ? count : 1) - 1, buff.lines());
   }
   else
   {
-    from.top += split_.size+1;
-    from.height -= split_.size+1;
+    std::string_view text = buff.getLine(cursor.row);
+    bool big = motion == Action::VIM_NEXT_BIGWORD;
+    size_t col = cursor.col-1;
+    uint8_t cls = charClass(text, col, big);
+    if (op == 'c' and (motion == Action::VIM_NEXT_WORD or big) and cls)
+    {
+      // cw on a word is ce, but stays on the last char of a word
+      motion = big ? Action::VIM_BIGWORD_END : Action::VIM_WORD_END;
+      uint32_t n = count ? count : 1;
+      size_t next = nextChar(text, col);
+      if (next >= text.length() or charClass(text, next, big) != cls) n--;
+      if (n) end = wordEnd(buff, end, n, big);
+    }
+    else if (not move(motion, end, count, textArea(win), vim))
+      return;
+    if ((motion == Action::VIM_MOVE_UP or motion == Action::VIM_MOVE_DOWN) and end.row == cursor.row) return;
+    switch(motion)
+    {
+      case Action::VIM_MOVE_UP: case Action::VIM_MOVE_DOWN: case Action::VIM_MOVE_DOC_END:
+      case Action::VIM_MOVE_DOC_BEGIN: case Action::VIM_SCREEN_TOP: case Action::VIM_SCREEN_MIDDLE:
+      case Action::VIM_SCREEN_BOTTOM:
+        linewise = true;
+        break;
+      case Action::VIM_WORD_END: case Action::VIM_BIGWORD_END: case Action::VIM_MOVE_LINE_END:
+      case Action::VIM_MATCH_PAIR: case Action::VIM_FIND: case Action::VIM_TILL:
+        end.col = nextChar(buff.getLine(end.row), end.col-1)+1;  // inclusive
+        break;
+      case Action::VIM_FIND_REPEAT: case Action::VIM_FIND_REVERSE:
+        if (end.col > cursor.col) end.col = nextChar(text, end.col-1)+1;
+        break;
+      default:
+        break;
+    }
+    if (end.row < start.row or (end.row == start.row and end.col < start.col)) std::swap(start, end);
+    if (linewise)
+      ;
+    else if (end.row > start.row and end.col == 1)
+    {
+      // An exclusive motion to the start of a line stops at the end of the previous one
+      if (start.col <= firstNonBlank(buff.getLine(start.row)))
+      {
+        linewise = true;
+        end.row--;
+      }
+      else
+        end = Cursor(end.row-1, buff.getLine(end.row-1).length()+1);
+    }
+    else if (end.row == buff.lines() and end.col > (int)buff.getLine(end.row).length())
+      end.col = buff.getLine(end.row).length()+1;
   }
-  if (side_0)
+  if (linewise and start.row > end.row) std::swap(start.row, end.row);
+  if (linewise) end.col = 1;
+  if (op == '<' or op == '>' or op == '=')
   {
-    Term << indent << "side_0:" << endl;
-    side_0->dump(from, indent, wid_0);
+    // Lines of the range, not yanked
+    buff.indentLines(start.row, end.row, op);
+    cursor = Cursor(start.row, firstNonBlank(buff.getLine(start.row)));
+    validateCursor(win, vim);
+    return;
   }
-  else
-    Term << indent << "wid_0:" << hex(wid_0) << ' ' << from << endl;
-}
 
-void WindowBuffer::status(const Window& win, TinyTerm& term)
-{
-  uint16_t title_row = win.top+win.height;
-  if (title_row <= term.sy)
+  // Text of the range, lines end with '\r'
+  string clip;
+  for(Cursor::type row=start.row; row<=end.row; row++)
   {
-    std::string title = buff.filename();
-    title += buff.modified() ? '*' : ' ';
-    int16_t col=win.left+win.width-1-title.length();
-    while (col<win.left) { title.erase(0,1); col++; }
-    term.gotoxy(title_row, win.left+1);
-    term << ' ' << pos.row+cursor.row-1 << ' ' << pos.col+cursor.col-1 << "  ";
-    term.gotoxy(title_row, col);
-    term << title;
+    std::string_view line = buff.getLine(row);
+    size_t from = linewise or row != start.row ? 0 : std::min<size_t>(start.col-1, line.length());
+    size_t to = linewise or row != end.row ? line.length() : std::min<size_t>(end.col-1, line.length());
+    clip.append(line.substr(from, to-from));
+    if (linewise or row != end.row) clip += '\r';
   }
-}
+  vim.clip(clip);
 
-void WindowBuffer::draw(const Window& win, TinyTerm& term, uint16_t first, uint16_t last)
-{
- if (first==0)
-  {
-    last = first + win.height-1;
-  }
-  else
+  if (op == 'y')
   {
-    if (last==0) last=first;
-    if (last < pos.row) return;
-    if (first > pos.row+win.height) return;
-    first -= pos.row;
-    last -= pos.row;
+    cursor = linewise ? Cursor(start.row, cursor.row == start.row ? cursor.col : 1) : start;
+    validateCursor(win, vim);
+    return;
   }
-  if (last<first) return;
-  term << TinyTerm::hide_cur << TinyTerm::save_cursor;
-  for(uint16_t row=first; row<=last; row++)
+  if (linewise)
   {
-    term.gotoxy(win.top+row, win.left);
-    string s=buff.getLine(pos.row+row);
-    if (s.length()>(size_t)pos.col)
+    if (op == 'c')
     {
-      s = s.substr(pos.col-1, win.width);
-      term << s;
+      buff.deleteLines(start.row+1, end.row);
+      buff.takeLine(start.row).clear();
     }
     else
-      s.clear();
-    if (pos.row+row > buff.lines()) s="~";
-    if (win.width>(int)s.length())
-      term << string(win.width-s.length(), ' ');
-    yield();
+      buff.deleteLines(start.row, end.row);
+    start.row = std::max<Cursor::type>(1, std::min(start.row, buff.lines()));
+    start.col = op == 'c' ? 1 : firstNonBlank(buff.getLine(start.row));
   }
-  status(win, term);
-  term << TinyTerm::restore_cursor << TinyTerm::show_cur;
-}
-
-Cursor WindowBuffer::buffCursor() const
-{
-  return cursor+pos-Cursor(1,1);
+  else
+  {
+    string tail(buff.getLine(end.row).substr(std::min<size_t>(end.col-1, buff.getLine(end.row).length())));
+    string& line = buff.takeLine(start.row);
+    if (start.col <= (int)line.length()) line.erase(start.col-1);
+    line += tail;
+    buff.deleteLines(start.row+1, end.row);
+  }
+  if (op == 'c') vim.setMode(Vim::INSERT);
+  cursor = start;
+  validateCursor(win, vim);
 }
 
-void WindowBuffer::gotoWord(int dir, Cursor& cursor)
+void WindowBuffer::selectObject(const char* object, uint32_t count, const Window& win, Vim& vim)
 {
-  auto isSep = [](char c) { return not(isalnum(c) or c=='_'); };
-  cursor.col--;
-
-  const std::string& s = buff.getLine(cursor.row);
-  bool waitSep = not isSep(s[cursor.col]);
-  while(waitSep or isSep(s[cursor.col]))
-  {
-    waitSep = waitSep and not isSep(s[cursor.col]);
-    if (dir>0 and cursor.col==(int)s.length())
-    {
-      if (cursor.row==buff.lines()) { cursor.col++; return; }
-      waitSep=false;
-      cursor.row++;
-      cursor.col=1;
-    }
-    else if (dir<0 and cursor.col==0)
-    {
-      if (cursor.row==1) { cursor.col++; return; }
-      waitSep=false;
-      cursor.row--;
-      cursor.col = buff.getLine(cursor.row).length();
-    }
-    else
-      cursor.col += dir;
-  }
-  cursor.col++;
+  Cursor start, end;
+  bool linewise;
+  if (not textObject(object, count, start, end, linewise)) return;
+  if (not linewise) end.col = prevChar(buff.getLine(end.row), end.col-1)+1;  // last char
+  if (linewise != (vmode == Vim::VISUAL_LINE)) vim.setMode(linewise ? Vim::VISUAL_LINE : Vim::VISUAL);
+  invalidate(win, std::min(vstart.row, start.row), std::max(cursor.row, end.row));
+  vstart = start;
+  cursor = end;
+  validateCursor(win, vim);
 }
 
-void WindowBuffer::onAction(Action cmd, const Window& win, Vim& vim)
+void WindowBuffer::onAction(Action cmd, const Window& win, Vim& vim, uint32_t count)
 {
   Cursor buff_cur(buffCursor());
-  Cursor redraw(0,0);           // (line_to_redraw / lines to redraw)
-  redraw.row = buff_cur.row;    // Redraw current line by default
-  Cursor del_from(0,0);
   int8_t mode=-1;
 
   vdebug("w.cmd", (int)cmd);
@@ -939,12 +4831,18 @@ void WindowBuffer::onAction(Action cmd, const Window& win, Vim& vim)
   vdebug("w.buff_cur", buff_cur);
   vdebug("buff.lines", buff.lines());
 
-  std::string& line=buff.takeLine(buff_cur.row);
+  // Motions do not touch the buffer
+  static string unchanged;
+  std::string& line = isChange(cmd) ? buff.takeLine(buff_cur.row) : unchanged;
+  Window area = textArea(win);
   switch(cmd)
   {
     case Action::VIM_CHANGE:
-      del_from = buff_cur;
-      buff_cur.row++;
+      if (buff_cur.col <= (int)line.length())
+      {
+        vim.clip(line.substr(buff_cur.col-1));
+        line.erase(buff_cur.col-1);
+      }
       mode=Vim::INSERT;
       break;
     case Action::VIM_PUT_BEFORE:
@@ -958,12 +4856,11 @@ void WindowBuffer::onAction(Action cmd, const Window& win, Vim& vim)
         if (not after) buff_cur.row--;
         while(clip.length())
         {
-          redraw.col=buff.lines()+1;
           buff_cur.row++;
           if (buff_cur.row>buff.lines() and buff.lines())
             buff_cur.row = buff.lines();
           buff.insertLine(buff_cur.row);
-          buff.takeLine(buff_cur.row) = clip.substr(0, cr-1);
+          buff.takeLine(buff_cur.row) = clip.substr(0, cr);
           clip.erase(0,cr+1);
           cr=clip.find('\r');
           if (cr==std::string::npos) cr=clip.length();
@@ -979,63 +4876,47 @@ void WindowBuffer::onAction(Action cmd, const Window& win, Vim& vim)
       break;
     }
     case Action::VIM_DELETE:
-      vim.clip(line.substr(buff_cur.col-1,1));
-      line.erase(buff_cur.col-1,1);
-      if (buff_cur.col>(int)line.length()) buff_cur.col--;
+    {
+      size_t len = nextChar(line, buff_cur.col-1)-(buff_cur.col-1);
+      vim.clip(line.substr(buff_cur.col-1, len));
+      line.erase(buff_cur.col-1, len);
       break;
+    }
     case Action::VIM_JOIN:
     {
       std::string s=buff.deleteLine(buff_cur.row+1);
       if (line.length() and line[line.length()-1]==' ') line.erase(line.length()-1,1);
       trim(s);
       line+=' '+s;
-      redraw={ buff_cur.row, buff.lines() };
       break;
     }
-    case Action::VIM_COPY_WORD: break;   // FIXME
-    case Action::VIM_COPY_LINE: vim.clip(line+'\r'); break;
-    case Action::VIM_DELETE_LINE:
-      vim.clip(line+'\r');
-      buff.deleteLine(buff_cur.row);
-      redraw.col=buff.lines();
-      break;
     case Action::VIM_OPEN_LINE:
-      buff_cur.col=1;
+    {
+      string indent;
+      if (buff.local.autoindent) indent = line.substr(0, line.find_first_not_of(" \t"));
       buff.insertLine(++buff_cur.row);
+      buff_cur.col = indent.length()+1;
+      if (indent.length()) buff.takeLine(buff_cur.row) = indent;
+      mode=Vim::INSERT;
+      break;
+    }
+    case Action::VIM_APPEND:
       mode=Vim::INSERT;
-      redraw.col=buff.lines();
+      buff_cur.col = nextChar(line, buff_cur.col-1)+1;
+      break;
+    default:
+      move(cmd, buff_cur, count, area, vim);
       break;
-    case Action::VIM_APPEND: mode=Vim::INSERT;
-    case Action::VIM_MOVE_RIGHT: buff_cur.col++; redraw.row=0; break;
-    case Action::VIM_MOVE_LEFT: buff_cur.col--; redraw.row=0; break;
-    case Action::VIM_MOVE_UP: buff_cur.row--; redraw.row=0; break;
-    case Action::VIM_MOVE_DOWN: buff_cur.row++; redraw.row=0; break;
-    case Action::VIM_MOVE_LINE_END: buff_cur.col=line.length(); redraw.row=0; break;
-    case Action::VIM_MOVE_LINE_BEGIN: buff_cur.col=1; redraw.row=0; break;
-    case Action::VIM_MOVE_DOC_END: buff_cur.row=buff.lines(); break;
-    case Action::VIM_CHANGE_WORD: mode=Vim::INSERT;
-    case Action::VIM_DELETE_WORD: del_from = buff_cur;
-    case Action::VIM_NEXT_WORD: gotoWord(1, buff_cur); break;
-    case Action::VIM_PREV_WORD: gotoWord(-1, buff_cur); break;
   }
   if (mode>=0) vim.setMode(mode);
-  if (del_from.row)
+  if (vmode)
   {
-    if (buff_cur.row==del_from.row)
-    {
-      vim.clip(line.substr(del_from.col));
-      line.erase(del_from.col-1, buff_cur.col-del_from.col);
-    }
-    else
-    {
-      vim.clip(line.substr(del_from.col));
-      line.erase(del_from.col-1);
-    }
-    buff_cur = del_from;
+    // Only rows between old and new cursor change their selection state
+    Cursor::type row = cursor.row;
+    if (vmode == Vim::VISUAL_BLOCK and buff_cur.col != cursor.col) row = vstart.row;
+    invalidate(win, std::min(row, buff_cur.row), std::max(row, buff_cur.row));
   }
-  if (redraw.row) draw(win, vim.getTerm(), redraw.row, redraw.row+redraw.col);
-  buff_cur -= buffCursor();
-  cursor += buff_cur;
+  cursor = buff_cur;
   validateCursor(win, vim);
 }
 
@@ -1043,7 +4924,6 @@ void WindowBuffer::onKey(TinyTerm::KeyCode key, const Window& win, Vim& vim)
 {
   uint8_t count=1;
   const VimSettings& settings(vim.settings);
-  Cursor cdraw(0,0);
   Cursor buff_cur(buffCursor());
 
   bool edit_mode = settings.mode & Vim::EDIT_MODE;
@@ -1055,138 +4935,437 @@ void WindowBuffer::onKey(TinyTerm::KeyCode key, const Window& win, Vim& vim)
     {
       if (settings.mode == Vim::INSERT)
       {
-        cdraw={ buff_cur.row, buff.lines()};
         buff.insertLine(buff_cur.row+1);
         string &s = buff.takeLine(buff_cur.row);
         buff_cur.row++;
         string &nl = buff.takeLine(buff_cur.row);
-        while(s[nl.length()]==' ') nl += ' ';
-        if (buff_cur.col < (int)s.length())
+        if (buff.local.autoindent)
+        {
+          size_t indent = std::min<size_t>(s.find_first_not_of(" \t"), s.length());
+          nl.assign(s, 0, std::min<size_t>(indent, cursor.col-1));
+        }
+        buff_cur.col = nl.length()+1;
+        if (cursor.col <= (int)s.length())
         {
-          nl += s.substr(buff_cur.col-1);
-          s.erase(buff_cur.col);
+          nl += s.substr(cursor.col-1);
+          s.erase(cursor.col-1);
         }
-        cursor.col = nl.length()+1;
       }
       else
-        cursor.col=1;
-      cursor.row++;
+      {
+        buff_cur.row++;
+        buff_cur.col=1;
+      }
       break;
     }
     case TinyTerm::KEY_BACK:
     {
-      std::string& line=buff.takeLine(buff_cur.row);
       if (buff_cur.col > 1)
       {
-        cursor.col--;
-        if (edit_mode and (int)line.length() >= buff_cur.col-1)
-        {
-          line.erase(buff_cur.col-2, 1);
-          cdraw.row = buff_cur.row;
-        }
+        const string& line = buff.getLine(buff_cur.row);
+        buff_cur.col = prevChar(line, buff_cur.col-1)+1;
+        if (edit_mode and (int)line.length() >= buff_cur.col)
+          buff.takeLine(buff_cur.row).erase(buff_cur.col-1, cursor.col-buff_cur.col);
       }
       break;
     }
     case TinyTerm::KEY_SUPPR:
     {
-      std::string& line=buff.takeLine(buff_cur.row);
+      const string& line = buff.getLine(buff_cur.row);
       if (edit_mode && buff_cur.col<=(int)line.length())
       {
-        line.erase(buff_cur.col-1, 1);
-        cdraw.row = buff_cur.row;
+        size_t len = nextChar(line, buff_cur.col-1)-(buff_cur.col-1);
+        buff.takeLine(buff_cur.row).erase(buff_cur.col-1, len);
       }
       break;
     }
-    case TinyTerm::KEY_HOME: pos.col=1; cursor.col=1; break;
-    case TinyTerm::KEY_END: pos.col=buff.getLine(buff_cur.row).length(); break;
-    case TinyTerm::KEY_CTRL_I:  // tab
-      if (settings.mode) break;
-      if (vim.settings.ts == 0) break;
-      count = pos.col % vim.settings.ts;
-      if (count==0) count=vim.settings.ts;
-      break;
+    case TinyTerm::KEY_HOME: buff_cur.col=1; break;
+    case TinyTerm::KEY_END: buff_cur.col=buff.getLine(buff_cur.row).length()+1; break;
     default:
-      if (key>=' ' && key<256 && edit_mode)
+      if (key == TinyTerm::KEY_CTRL_I and settings.mode == Vim::INSERT and buff.local.expandtab)
+      {
+        std::string& line = buff.takeLine(buff_cur.row);
+        while((int)line.length()<buff_cur.col-1) line+=' ';
+        size_t spaces = buff.tabStop() - buff.displayCol(buff_cur.row, buff_cur.col-1) % buff.tabStop();
+        line.insert(buff_cur.col-1, spaces, ' ');
+        buff_cur.col += spaces;
+      }
+      else if ((key>=' ' or key==TinyTerm::KEY_CTRL_I) && key<256 && edit_mode)
       {
         std::string& line=buff.takeLine(buff_cur.row);
-        while((int)line.length()<buff_cur.col) line+=' ';
+        size_t length = line.length();
+        while((int)line.length()<buff_cur.col-1) line+=' ';
         while(count--)
         {
-          if ((int)line.length()<buff_cur.col or settings.mode==Vim::INSERT)
-            line.insert(buff_cur.col-1, 1, key);
-          else
-            line[buff_cur.col-1]=key;
+          // Replace a whole char when its first byte is typed
+          if (settings.mode==Vim::REPLACE and not isUtf8Cont(key))
+            line.erase(buff_cur.col-1, nextChar(line, buff_cur.col-1)-(buff_cur.col-1));
+          line.insert(buff_cur.col-1, 1, key);
+        }
+        if (settings.mode == Vim::INSERT and key >= ' ' and key < 127 and line.length() == length+1)
+        {
+          typed_row = buff_cur.row;
+          typed_byte = buff_cur.col-1;
+          typed_version = buff.version();
         }
-        cursor.col++;
-        cdraw.row=buff_cur.row;
+        buff_cur.col++;
       }
       break;
   }
 
-  if (cdraw.row) draw(win, vim.getTerm(), cdraw.row, cdraw.col);
+  cursor = buff_cur;
+  validateCursor(win, vim);
+}
+
+void WindowBuffer::insertText(const string& text, const Window& win, Vim& vim)
+{
+  Cursor buff_cur(buffCursor());
+  string& line = buff.takeLine(buff_cur.row);
+  while((int)line.length() < buff_cur.col-1) line += ' ';
+  size_t eol = text.find('\r');
+  if (eol == string::npos)
+  {
+    line.insert(buff_cur.col-1, text);
+    buff_cur.col += text.length();
+  }
+  else
+  {
+    // The end of the line goes after the text, the lines are inserted at once
+    string tail = line.substr(buff_cur.col-1);
+    line.erase(buff_cur.col-1);
+    line.append(text, 0, eol);
+    buff.insertLines(buff_cur.row+1, std::count(text.begin(), text.end(), '\r'));
+    while(eol != string::npos)
+    {
+      size_t start = eol+1;
+      eol = text.find('\r', start);
+      string& next = buff.takeLine(++buff_cur.row);
+      next.assign(text, start, eol == string::npos ? eol : eol-start);
+      buff_cur.col = next.length()+1;
+    }
+    buff.takeLine(buff_cur.row) += tail;
+  }
+  cursor = buff_cur;
+  validateCursor(win, vim);
+}
+
+void WindowBuffer::jumpTo(const Cursor& to, const Window& win, Vim& vim)
+{
+  buff.pushJump(cursor);
+  cursor = to;
   validateCursor(win, vim);
 }
 
-void adjust(Cursor::type& cursor, Cursor::type& pos, Cursor::type max, int scroll)
+Cursor::type WindowBuffer::lastVisibleRow(const Window& text)
 {
-  vdebug("adjusting", cursor << ' ' << pos << ' ' << max << ' ' << scroll);
-  int delta = 0;
-  if (cursor>max)
-    delta = cursor-max + scroll;
-  else if (cursor <=0)
-    delta = cursor+1-scroll;
-  if (delta)
+  if (not wrap) return std::min<int32_t>(pos.row+text.height-1, buff.lines());
+  int32_t rows = -pos_sub;
+  Cursor::type row = pos.row;
+  while(row < buff.lines())
   {
-    cursor -=delta;
-    pos += delta;
+    rows += wrapsOf(row, text.width).size();
+    if (rows >= text.height) break;
+    row++;
   }
-  auto maxcur = max-scroll;
-  vdebug("adjusted 1=", delta << ' ' << cursor << ' ' << pos << ' ' << max << ' ' << scroll);
-  while (cursor<scroll and cursor<maxcur and pos>1) { pos--; cursor++; }
-  while (pos<1 and cursor>=1) { pos++; cursor--; }
-  vdebug("adjusted 2=", delta << ' ' << cursor << ' ' << pos << ' ' << max << ' ' << scroll);
+  return row;
+}
+
+void WindowBuffer::scrollTo(Cursor::type top)
+{
+  if (top == pos.row and pos_sub == 0) return;
+  pos.row = top;
+  pos_sub = 0;
+  dirty_all = true;
+}
+
+// Scrolls pos (a row or a column) so that cur is visible in size, with a margin of scroll
+template<class T>
+void adjust(int32_t cur, T& pos, int32_t size, int32_t scroll)
+{
+  vdebug("adjusting", cur << ' ' << pos << ' ' << size << ' ' << scroll);
+  if (scroll*2 >= size) scroll = (size-1)/2;
+  int64_t p = pos;
+  if ((int64_t)cur-scroll < p) p = (int64_t)cur-scroll;
+  if ((int64_t)cur+scroll > p+size-1) p = (int64_t)cur+scroll-size+1;
+  pos = Cursor::clamp<T>(std::max<int64_t>(p, 1));
 }
 
-void WindowBuffer::validateCursor(const Window& win, Vim& vim)
+void WindowBuffer::validateCursor(const Window& area, Vim& vim)
 {
   Cursor old_pos = pos;
-  adjust(cursor.col, pos.col, win.width, vim.settings.scrolloff);
-  // adjust(cursor.row, pos.row, win.height, vim.settings.scrolloff);
+  // No gutter for the command line
+  bool numbered = not vim.isCommandLine(buff);
+  if (number != (numbered and vim.settings.number) or relnumber != (numbered and vim.settings.relativenumber))
+  {
+    number = numbered and vim.settings.number;
+    relnumber = numbered and vim.settings.relativenumber;
+    dirty_all = true;
+  }
+  if (gutter != gutterWidth())
+  {
+    gutter = gutterWidth();
+    dirty_all = true;
+  }
+  Window win = textArea(area);
 
-  if (cursor.col<=0)
+  // Cursor on a char of the buffer (or after the line in edition modes)
+  if (cursor.row > buff.lines()) cursor.row = buff.lines();
+  if (cursor.row < 1) cursor.row = 1;
+  const string& line = buff.getLine(cursor.row);
+  int16_t max_col = line.length()+1;
+  if (not (vim.settings.mode & Vim::EDIT_MODE)) max_col = prevChar(line, line.length())+1;
+  if (cursor.col > max_col) cursor.col = max_col;
+  if (cursor.col < 1) cursor.col = 1;
+  while(cursor.col > 1 and cursor.col <= (int)line.length() and isUtf8Cont(line[cursor.col-1])) cursor.col--;
+
+  if (wrap != (vim.settings.wrap != 0))
+  {
+    wrap = vim.settings.wrap;
+    wraps.clear();
+    pos_sub = 0;
+    pos.col = 1;
+    dirty_all = true;
+  }
+  if (wrap)
   {
-    pos.col += cursor.col-1;
-    if (pos.col<0) pos.col=1;
-    cursor.col=1;
+    // Scroll by screen rows, walking only the rows near the window
+    int16_t so = vim.settings.scrolloff;
+    if (so*2 >= win.height) so = (win.height-1)/2;
+    uint16_t old_sub = pos_sub;
+    int16_t row = screenRow(win, 2*win.height);
+    if (row < 0 or row >= 2*win.height)
+    {
+      bool below = row >= 0;
+      pos.row = cursor.row;
+      pos_sub = buff.displayCol(cursor.row, cursor.col-1) / win.width;
+      row = scrollUp(win.width, below ? win.height-1-so : so);
+    }
+    if (row < so)
+      scrollUp(win.width, so-row);
+    else if (row > win.height-1-so)
+      scrollDown(win.width, row-(win.height-1-so));
+    if (old_sub != pos_sub) dirty_all = true;
   }
-  if (cursor.row<=0)
+  else
   {
-    pos.row += cursor.row-1;
-    if (pos.row<0) pos.row=1;
-    cursor.row=1;
+    adjust(cursor.row, pos.row, win.height, vim.settings.scrolloff);
+    // scrolloff does not scroll down past the last line
+    Cursor::type last_top = std::max<Cursor::type>(1, buff.lines()-win.height+1);
+    if (pos.row > last_top and pos.row > old_pos.row) pos.row = std::max(last_top, old_pos.row);
+    adjust(buff.displayCol(cursor.row, cursor.col-1)+1, pos.col, win.width, vim.settings.sidescrolloff);
   }
-  if (pos.row > buff.lines()) pos.row = buff.lines();
-  if (pos.row<1) pos.row=1;
-  Cursor cur=buffCursor();
-  auto l=buff.getLine(cur.row).length();
-  if (l and pos.col>(int)l) pos.col=l;
-  else if (pos.col<1) pos.col=1;
   vdebug("lines", buff.lines());
   if (old_pos != pos)
   {
     vdebug("val_draw", 'y' << pos << '/' << old_pos);
-    draw(win, vim.getTerm());
+    Cursor::type down = pos.row - old_pos.row;
+    if (not wrap and pos.col == old_pos.col and down > 0 and down < win.height)
+    {
+      // paint() scrolls the terminal, only the rows coming in are drawn
+      scrolled += down;
+      invalidate(win, pos.row+win.height-down, pos.row+win.height-1);
+    }
+    else
+      dirty_all = true;
+  }
+  if (relnumber and cursor.row != numbered_row)
+  {
+    gutter_dirty = true;
+    numbered_row = cursor.row;
   }
   else vdebug("val_draw", 'n' << pos << '/' << old_pos);
-  vim.getTerm() << TinyTerm::hide_cur;
-  status(win, vim.getTerm());
-  vim.getTerm().gotoxy(win.top+cursor.row-1, win.left+cursor.col-1);
-  vim.getTerm() << TinyTerm::show_cur;
 }
 
-void WindowBuffer::focus(TinyTerm& term)
+bool WindowBuffer::paintTyped(const Window& area, TinyTerm& term)
+{
+  Cursor::type row = typed_row;
+  typed_row = 0;
+  if (row == 0 or typed_version != buff.version() or typed_version != version+1) return false;
+  // Soft wrap and syntax can change the rest of the row, a tab absorbs the
+  // shift, the cells pushed out of the window must leave the screen
+  if (dirty_all or scrolled or wrap or vmode or buff.syntax()) return false;
+  if (area.left+area.width-1 != term.sx) return false;
+  Window win = textArea(area);
+  uint16_t col = buff.displayCol(row, typed_byte);
+  const string& line = buff.getLine(row);
+  if (line.find('\t', typed_byte) != string::npos) return false;
+  if (row < pos.row or row >= pos.row+win.height) return false;
+  if (col < pos.col-1 or col >= pos.col-1+win.width) return false;
+  term.gotoxy(win.top+row-pos.row, win.left+col-(pos.col-1));
+  if (typed_byte+1 < line.length()) term << "\033[@";  // ICH
+  term << line[typed_byte];
+  return true;
+}
+
+bool WindowBuffer::stale() const
+{
+  return version != buff.version();
+}
+
+bool WindowBuffer::paint(const Window& area, TinyTerm& term)
+{
+  if (gutter != gutterWidth())
+  {
+    gutter = gutterWidth();  // a power of ten was crossed
+    dirty_all = true;
+  }
+  Window win = textArea(area);
+  if (paintTyped(area, term))
+    version = buff.version();
+  if (not buff.changes(version, [this, &win](Cursor::type first, Cursor::type last)
+      { invalidate(win, first, last); }))
+    dirty_all = true;
+  version = buff.version();
+  if (wrap)
+  {
+    syncWraps(win.width);
+    if (wrap_shift) invalidate(win, wrap_shift, std::numeric_limits<Cursor::type>::max());
+    wrap_shift = 0;
+  }
+  if (scrolled and not dirty_all)
+  {
+    // A scroll region of full width rows, the line feeds at its bottom move it up
+    if (area.left == 1 and area.width == term.sx and scrolled < win.height)
+    {
+      uint16_t bottom = win.top+win.height-1;
+      term << "\033[" << win.top << ';' << bottom << 'r';
+      term.gotoxy(bottom, 1);
+      term << string(scrolled, '\n') << "\033[r";
+    }
+    else
+      dirty_all = true;
+  }
+  scrolled = 0;
+  bool drawn = dirty_all or gutter_dirty or dirty.size();
+  if (dirty_all)
+    draw(area, term);
+  else
+  {
+    if (gutter_dirty) drawGutter(win, term);
+    // Consecutive rows are drawn at once
+    auto it = dirty.begin();
+    while(it != dirty.end())
+    {
+      Cursor::type first = *it;
+      Cursor::type last = first;
+      while(++it != dirty.end() and *it == last+1) last++;
+      draw(area, term, first, last);
+    }
+    dirty.clear();
+  }
+  gutter_dirty = false;
+  return drawn;
+}
+
+void WindowBuffer::focus(const Window& area, TinyTerm& term)
+{
+  Window win = textArea(area);
+  Cursor screen = screenCursor(win);
+  term << TinyTerm::hide_cur;
+  status(area, term);
+  term.gotoxy(win.top+screen.row-1, win.left+screen.col-1);
+  term << TinyTerm::show_cur;
+}
+
+size_t Transport::write(const uint8_t* bytes, size_t n)
+{
+  if (output.empty()) output_since = millis();
+  for(size_t i=0; i<n; i++)
+  {
+    output += (char)bytes[i];
+    if (options.telnet and bytes[i] == 0xFF) output += (char)0xFF;  // IAC IAC
+    if (output.length() >= options.packet) flush();
+  }
+  return n;
+}
+
+void Transport::begin()
+{
+  if (not options.telnet) return;
+  // IAC WILL ECHO, IAC WILL SUPPRESS-GO-AHEAD, IAC DONT LINEMODE: the client
+  // sends each key at once and does not echo it, replies are filtered
+  static const char negotiation[] = { '\xFF', '\xFB', 1, '\xFF', '\xFB', 3, '\xFF', '\xFE', 34 };
+  output.append(negotiation, sizeof(negotiation));
+  flush();
+}
+
+void Transport::flush()
+{
+  if (output.empty()) return;
+  size_t sent = link.write((const uint8_t*)output.data(), output.length());
+  if (sent) packets_++;
+  output.erase(0, sent);
+  output_since = millis();  // the rest is sent by the next poll
+  link.flush();
+}
+
+void Transport::poll()
+{
+  if (output.length() and millis()-output_since >= options.delay) flush();
+}
+
+int Transport::available()
+{
+  poll();
+  receive();
+  return input.length();
+}
+
+int Transport::read()
+{
+  receive();
+  if (input.empty()) return -1;
+  uint8_t c = input[0];
+  input.erase(0, 1);
+  return c;
+}
+
+int Transport::peek()
+{
+  receive();
+  return input.empty() ? -1 : (uint8_t)input[0];
+}
+
+void Transport::receive()
 {
-  term.gotoxy(cursor.row, cursor.col);
+  // telnet: IAC (255) is followed by a command, WILL WONT DO DONT (251-254)
+  // by an option, SB (250) starts a negotiation that ends with IAC SE (240).
+  // CR is sent as CR NUL or CR LF.
+  enum { NONE, COMMAND, OPTION, NEGOTIATION, NEGOTIATION_IAC, CR };
+  while(link.available() > 0)
+  {
+    int c = link.read();
+    if (c < 0) break;
+    if (not options.telnet)
+    {
+      input += (char)c;
+      continue;
+    }
+    switch(iac)
+    {
+      case COMMAND:
+        if (c == 0xFF) input += (char)c;
+        iac = c == 250 ? NEGOTIATION : c >= 251 and c <= 254 ? OPTION : NONE;
+        break;
+      case OPTION: iac = NONE; break;
+      case NEGOTIATION: if (c == 0xFF) iac = NEGOTIATION_IAC; break;
+      case NEGOTIATION_IAC: iac = c == 240 ? NONE : NEGOTIATION; break;
+      default:
+      {
+        bool after_cr = iac == CR;
+        iac = NONE;
+        if (c == 0xFF)
+          iac = COMMAND;
+        else if (c == '\r')
+        {
+          input += (char)c;
+          iac = CR;
+        }
+        else if (not after_cr or (c != 0 and c != '\n'))
+          input += (char)c;
+      }
+    }
+  }
 }
 
 }
@@ -1,42 +1,58 @@
 #pragma once
+#include <algorithm>
+#include <limits>
 #include <list>
 #include <memory>
 #include <map>
+#include <set>
 #include <vector>
 #include "TinyApp.h"
+#include "file_util.h"
 
 namespace tiny_vim
 {
 
-//                                      0         5            10        15         20            25
-static constexpr const char* actions = "i,a,R,J,C,cw,x,p,P,U,.,o,h,j,k,l,w,b,$,G,yy,yw,dd,dw,dt,q,0:^,n";
+//                                      0         5         10        15        20          25        30        35        40
+static constexpr const char* actions = "i,a,R,J,C,x,p,P,U,.,o,h,j,k,l,w,b,$,G,q,0:^,n,@,v,V,m,',`,e,W,B,E,f,t,F,T,;,%,{,},gg,H,M,L";
 enum class Action {
       VIM_INSERT, VIM_APPEND, VIM_REPLACE, VIM_JOIN, VIM_CHANGE,
-      VIM_CHANGE_WORD, VIM_DELETE, VIM_PUT_AFTER, VIM_PUT_BEFORE, VIM_UNDO, VIM_REPEAT,
+      VIM_DELETE, VIM_PUT_AFTER, VIM_PUT_BEFORE, VIM_UNDO, VIM_REPEAT,
       VIM_OPEN_LINE, VIM_MOVE_LEFT, VIM_MOVE_DOWN, VIM_MOVE_UP, VIM_MOVE_RIGHT,
-      VIM_NEXT_WORD, VIM_PREV_WORD, VIM_MOVE_LINE_END, VIM_MOVE_DOC_END, VIM_COPY_LINE,
-      VIM_COPY_WORD, VIM_DELETE_LINE, VIM_DELETE_WORD, VIM_QUIT, VIM_DELETE_TILL,
-      VIM_MOVE_LINE_BEGIN, VIM_SEARCH_NEXT, VIM_UNKNOWN, VIM_UNTERMINATED
+      VIM_NEXT_WORD, VIM_PREV_WORD, VIM_MOVE_LINE_END, VIM_MOVE_DOC_END, VIM_RECORD,
+      VIM_MOVE_LINE_BEGIN, VIM_SEARCH_NEXT, VIM_PLAY, VIM_VISUAL, VIM_VISUAL_LINE,
+      VIM_MARK, VIM_GOTO_MARK_LINE, VIM_GOTO_MARK, VIM_WORD_END, VIM_NEXT_BIGWORD,
+      VIM_PREV_BIGWORD, VIM_BIGWORD_END, VIM_FIND, VIM_TILL, VIM_FIND_BACK, VIM_TILL_BACK,
+      VIM_FIND_REPEAT, VIM_MATCH_PAIR, VIM_PREV_PARAGRAPH, VIM_NEXT_PARAGRAPH, VIM_MOVE_DOC_BEGIN,
+      VIM_SCREEN_TOP, VIM_SCREEN_MIDDLE, VIM_SCREEN_BOTTOM,
+      // Not in actions (',' and control keys)
+      VIM_FIND_REVERSE, VIM_HALF_PAGE_DOWN, VIM_HALF_PAGE_UP, VIM_PAGE_DOWN, VIM_PAGE_UP,
+      VIM_UNKNOWN, VIM_UNTERMINATED
 };
 
 using Wid=uint16_t;
+using ViewId=uint32_t;  // session << 16 | Wid, a buffer can be shown by several Vim
 using string=std::string;
 
 void error(const char*);
 
 class Splitter;
 class Buffer;
+struct Syntax;
 struct Window;
 class Vim;
 struct VimSettings;
 
+// Rows are 32 bits (lines_max), columns are bytes of a line and stay 16 bits.
+// lines_max leaves room for a row plus a count and a window height.
 struct Cursor
 {
-  using type = int16_t;
+  using type = int32_t;      // row
+  using col_type = int16_t;  // byte (1 based)
+  static constexpr type lines_max = 1 << 24;
   type row;
-  type col;
+  col_type col;
   Cursor() : row(1), col(1) {}
-  Cursor(type row, type col) : row(row), col(col) {}
+  Cursor(type row, col_type col) : row(row), col(col) {}
   friend Stream& operator << (Stream& out, const Cursor& c)
   {
     out << '(' << c.row << ',' << c.col << ')';
@@ -47,36 +63,149 @@ struct Cursor
   friend bool operator != (const Cursor& l, const Cursor& r)
   { return not (l==r); }
   friend Cursor operator+(const Cursor& l, const Cursor& r)
-  { return Cursor(l.row+r.row, l.col+r.col); }
+  { return Cursor(clamp<type>((int64_t)l.row+r.row), clamp<col_type>(l.col+r.col)); }
   friend Cursor operator-(const Cursor& l, const Cursor& r)
-  { return Cursor(l.row-r.row, l.col-r.col); }
-  Cursor& operator -=(const Cursor& c)
-  { row -= c.row; col -= c.col; return *this; }
-  Cursor& operator +=(const Cursor& c)
-  { row += c.row; col += c.col; return *this; }
+  { return Cursor(clamp<type>((int64_t)l.row-r.row), clamp<col_type>(l.col-r.col)); }
+  Cursor& operator -=(const Cursor& c) { return *this = *this - c; }
+  Cursor& operator +=(const Cursor& c) { return *this = *this + c; }
+
+  // saturates instead of wrapping
+  template<class T>
+  static T clamp(int64_t v)
+  {
+    return (T)std::max<int64_t>(std::numeric_limits<T>::min(),
+                                std::min<int64_t>(v, std::numeric_limits<T>::max()));
+  }
+};
+
+// Settings are declared once, in setting_decls (TinyVim.cpp)
+struct VimSettings
+{
+  enum Type : uint8_t { NUMBER, BOOLEAN, TEXT };
+  enum Scope : uint8_t { GLOBAL, BUFFER };  // BUFFER: Buffer::local has its own value
+  static constexpr uint8_t text_size = 8;
+  using Text = char[text_size];
+  struct Decl
+  {
+    const char* name;
+    const char* abbrev;
+    Type type;
+    Scope scope;
+    uint8_t VimSettings::* number;  // NUMBER and BOOLEAN
+    Text VimSettings::* text;       // TEXT
+    uint8_t def;
+    const char* def_text;
+  };
+
+  VimSettings();  // defaults of setting_decls
+  // name or abbreviation lookup, nullptr if unknown
+  static const Decl* find(const char* name, size_t len);
+  static const Decl* begin();
+  static const Decl* end();
+  bool assign(const Decl&, const char* value, size_t len);
+  // name=value, name or noname (returns the length, 0 if no room)
+  size_t print(const Decl&, char* out, size_t size) const;
+  bool isDefault(const Decl&) const;
+
+  uint8_t scrolloff;
+  uint8_t sidescrolloff;
+  uint8_t ts;
+  uint8_t wrap;
+  uint8_t number;
+  uint8_t relativenumber;
+  uint8_t autoindent;
+  uint8_t shiftwidth;  // 0: tabstop
+  uint8_t expandtab;
+  Text filetype;
+
+  uint8_t mode = 0;  // not a setting
 };
 
 class WindowBuffer
 {
   public:
     WindowBuffer(Buffer& buffer) : pos(1,1), buff(buffer) { cursor=pos; }
-    void draw(const Window& win, TinyTerm& term, uint16_t first=0, uint16_t last=0);
-    void focus(TinyTerm& term);
+    void draw(const Window& win, TinyTerm& term, Cursor::type first=0, Cursor::type last=0);
+    void focus(const Window& win, TinyTerm& term);  // status and cursor
     // returns true if end of command
     void onKey(TinyTerm::KeyCode, const Window&, Vim&);
-    void onAction(Action, const Window&, Vim&);
+    // count is 0 if none was typed, motions apply it at once
+    void onAction(Action, const Window&, Vim&, uint32_t count=0);
+    // Operator d c y on a motion, on a text object (iw, a{...)
+    // or on count lines if there is neither (dd cc yy)
+    void onOperator(char op, Action motion, const char* object, uint32_t count, const Window&, Vim&);
+    void selectObject(const char* object, uint32_t count, const Window&, Vim&);  // v iw...
+    void invalidate(const Window&, Cursor::type first, Cursor::type last=0);
+
+    // Start, change or end (mode=0) the visual selection
+    void visual(uint8_t mode, const Window&);
+    // Columns [from, to] of row that are selected
+    bool selection(Cursor::type row, Cursor::col_type& from, Cursor::col_type& to) const;
+    // Apply a d,x,y,c,<,>,~ operator to the selection
+    void onVisual(char op, const Window&, Vim&);
+    string visualKeys() const;  // select the same extent from the cursor (.)
+    // draw buffer changes and dirty rows, returns true if something was drawn
+    bool paint(const Window&, TinyTerm&);
     ~WindowBuffer() { Term << "~WindowBuffer "; }
-    Cursor buffCursor() const;  // compute position in file from pos and cursor (screen)
-    void gotoWord(int dir, Cursor&);
-    bool save(const std::string& filename, bool force);
-    void gotoxy(uint16_t row, uint16_t col=0);
+    Cursor buffCursor() const { return cursor; }
+    Buffer& buffer() const { return buff; }
+    bool stale() const;  // the buffer changed since the last paint
+    Cursor::type topRow() const { return pos.row; }
+    void gotoxy(Cursor::type row, Cursor::col_type col=0);
     void status(const Window& win, TinyTerm& term);
+    // Clamps the cursor and scrolls the window to show it
+    void validateCursor(const Window& win, Vim& term);
+    // Moves the cursor, the old position goes to the jump list
+    void jumpTo(const Cursor&, const Window&, Vim&);
+    // Text typed at once in insert mode (a paste), '\r' ends the lines
+    void insertText(const string& text, const Window&, Vim&);
 
   private:
-    void validateCursor(const Window& win, Vim& term);
-    Cursor pos;     // Top left of document (min is 1,1)
-    Cursor cursor;  // Cursor position (1,1 is top left)
+    bool move(Action, Cursor&, uint32_t count, const Window& text, Vim&);  // false if not a motion
+    // [start, end) of a text object, or rows start.row..end.row if linewise
+    bool textObject(const char* object, uint32_t count, Cursor& start, Cursor& end, bool& linewise);
+    // Window without the line numbers gutter
+    Window textArea(const Window& win) const;
+    uint8_t gutterWidth() const;
+    void drawGutter(const Window& text, TinyTerm&);
+    void printNumber(TinyTerm&, Cursor::type row, bool wrapped);
+    Cursor::type lastVisibleRow(const Window& text);
+    void scrollTo(Cursor::type top);  // Ctrl-D Ctrl-F...
+    Cursor screenCursor(const Window&);  // cursor position in the window (1,1 is top left)
+    // Soft wrap: byte offset of each screen row of a buffer row (cached)
+    const std::vector<size_t>& wrapsOf(Cursor::type row, uint16_t width);
+    void syncWraps(uint16_t width);
+    int16_t screenRow(const Window&, int16_t limit);  // of the cursor, -1 if above
+    uint16_t scrollUp(uint16_t width, uint16_t rows);
+    void scrollDown(uint16_t width, uint16_t rows);
+    Cursor pos;     // Top left of document (min is 1,1), col is a display column
+    uint16_t pos_sub = 0;  // soft wrap: first screen row of pos.row shown
+    Cursor cursor;  // Cursor position in buffer, col is a byte (1 based)
     Buffer& buff;
+    Cursor vstart;      // visual selection anchor (buffer position)
+    uint8_t vmode = 0;  // Vim::VISUAL... or 0
+    std::set<Cursor::type> dirty; // buffer rows to draw on next paint
+    bool dirty_all = false;
+    uint32_t version = 0;  // last buffer version drawn
+    bool wrap = false;
+    static constexpr uint8_t max_wraps = 128;
+    std::map<Cursor::type, std::vector<size_t>> wraps;
+    uint16_t wrap_width = 0;    // width of the cached wraps
+    uint32_t wrap_version = 0;  // buffer version of the cached wraps
+    Cursor::type wrap_shift = 0;  // rows from there moved (a height changed)
+    bool number = false;
+    bool relnumber = false;
+    uint8_t gutter = 0;             // width of the line numbers (0 if none)
+    bool gutter_dirty = false;      // relative numbers changed (cursor moved)
+    Cursor::type numbered_row = 0;  // cursor row of the relative numbers
+    Cursor::type scrolled = 0;      // rows the text moved up since the last paint
+    // A char typed in insert mode is painted alone (the terminal shifts the
+    // end of the row with ICH) if the buffer did not change otherwise
+    bool paintTyped(const Window& area, TinyTerm&);
+    Cursor::type typed_row = 0;     // 0 if none
+    size_t typed_byte = 0;
+    uint32_t typed_version = 0;     // of the buffer after the char
+    string title_shown;             // status title printed since the last full draw
 };
 
 class Buffer
@@ -87,26 +216,301 @@ class Buffer
 
     string filename() const { return filename_; }
     void reset();
-    bool read(const char* filename);
+    // Load and save are done by slices (Vim jobs): they open the file,
+    // then ioSlice() continues until done. The buffer is read only meanwhile.
+    // VIEW: read only, the lines stay in the file (see view_index)
+    // HEX: read only, rows of hex_width bytes of the file
+    enum Mode : uint8_t { EDIT, VIEW, HEX };
+    bool load(const char* filename, Mode mode=EDIT);
+    // Writes filename~ then renames it. Without force, an existing file is
+    // not replaced, nor the file read if it changed since (size, time).
     bool save(std::string filename, bool force);
+    // false when done, a load also stops once the buffer has rows lines
+    bool ioSlice(uint32_t deadline, uint8_t& progress, Cursor::type rows=0);
+    void ioCancel();
+    bool busy() const { return (bool)io_file; }
+    bool loading() const { return busy() and io_name.empty(); }
+    bool readOnly() const { return view_; }
+    bool hex() const { return hex_; }
+    // Follow mode (tail -f) of a view: poll() scans the bytes appended to
+    // the file since the last scan, the last follow_max lines stay in memory
+    bool follow(bool on);  // false if not a view
+    bool following() const { return following_; }
+    bool poll(uint32_t deadline);  // true if lines were added or changed
     const string& getLine(Cursor::type line) const;
     string& takeLine(Cursor::type line);
-    void insertLine(Cursor::type nr);
+    void insertLine(Cursor::type nr) { insertLines(nr, 1); }
+    void insertLines(Cursor::type nr, Cursor::type count);  // empty lines
     std::string deleteLine(Cursor::type nr);
+    void deleteLines(Cursor::type first, Cursor::type last);
     Cursor::type lines() const;
     bool modified() const { return modified_; }
-    WindowBuffer* addWindow(Wid wid);
-    void removeWindow(Wid wid) { wbuffs.erase(wid); }
-    void setFileName(const std::string& filename) { filename_ = filename; }
-    WindowBuffer* getWBuff(Wid wid);
+    WindowBuffer* addWindow(ViewId);
+    void removeWindow(ViewId view) { wbuffs.erase(view); }
+    void moveWindow(ViewId from, ViewId to);
+    void setFileName(const std::string& filename);
+    WindowBuffer* getWBuff(ViewId);
     ~Buffer() { Term << "~Buffer "; }
 
+    // Changes log shared by all windows showing the buffer
+    uint32_t version() const { return version_; }
+    void touch(Cursor::type first, Cursor::type last);
+    // calls fun(first, last) for rows changed after version 'since'
+    // returns false if the log is too short (everything must be drawn)
+    bool changes(uint32_t since, std::function<void(Cursor::type, Cursor::type)> fun) const;
+
+    // UTF-8 display columns (0 based) <-> bytes (0 based) of a line
+    uint16_t displayCol(Cursor::type row, size_t byte) const;
+    size_t byteAt(Cursor::type row, uint16_t col) const;  // first byte of the char at col
+    uint16_t displayWidth(Cursor::type row) const
+    { return displayCol(row, getLine(row).length()); }
+    uint8_t tabStop() const { return tabstop_; }
+    // Indents are display widths, made of tabs and spaces (only spaces
+    // with expandtab). indentLines() takes only the lines it changes:
+    // '>' and '<' shift them by shiftWidth(), '=' indents them by the
+    // brackets opened above them.
+    uint8_t shiftWidth() const { return local.shiftwidth ? local.shiftwidth : tabstop_; }
+    uint16_t indentWidth(std::string_view line) const;
+    string indentOf(uint16_t width) const;
+    void indentLines(Cursor::type first, Cursor::type last, char op);
+    uint8_t numberDigits() const;  // of the last line number
+    VimSettings local;     // values of the BUFFER settings
+    void applySettings();  // after a change of local
+
+    // Syntax highlighting, selected by the file extension (nullptr if none)
+    const Syntax* syntax() const { return syntax_; }
+    // lexer state at the start of row (end of row-1 states are cached)
+    uint8_t syntaxState(Cursor::type row);
+
+    // Marks 'a-'z, '' and the jump list follow the lines inserted or deleted
+    // above them. They are ordered by row so that an edit only visits the
+    // marks after it. Marks of deleted lines are removed ('' and the jumps
+    // move to the first line after the deletion).
+    void setMark(char name, const Cursor&);
+    bool getMark(char name, Cursor&) const;  // false if not set
+    void pushJump(const Cursor&);            // position before a jump, also ''
+    bool jump(int8_t dir, Cursor& pos);      // Ctrl-O (-1) / Ctrl-I (1) from pos
+
+    // Bracket enclosing pos: the open one before it, the close one after it.
+    // The bracket depth of lines is cached, so a search crossing lines
+    // scans only the line where the bracket is.
+    bool findOpen(char open, char close, Cursor& pos) const;
+    bool findClose(char open, char close, Cursor& pos) const;
+
+    // Recovery journal (filename.swp) of the edits since the last save.
+    // Records are appended in journal_block aligned writes from Vim::loop
+    // and the journal is replaced by a snapshot when it outgrows it (or
+    // the file), so the snapshots cost at most the size of the records.
+    // The snapshot is written by slices while the journal goes on, the
+    // records of the meantime start the new journal. Inserting or deleting
+    // lines cancels it.
+    void openJournal(bool recover);  // recover: replay an existing journal
+    void journal(bool idle);         // write complete blocks (all if idle)
+    void closeJournal();             // edits are saved, forget the journal
+    bool checkpointDue() const;
+    bool startCheckpoint();
+    bool checkpoint(uint32_t deadline, uint8_t& progress);  // false when done
+    void checkpointCancel();
+
+    // Cold blocks of pack_lines lines (far from the windows, not used
+    // recently) of big buffers are compressed when idle, their strings are
+    // freed. Reading a line loads its block again, a change drops it.
+    void pack(uint32_t deadline);
+    string packInfo() const;  // blocks, ratio and load times
+    // getLine() references stay valid until releaseBlocks(), it is called
+    // where none is held (each loop, between the lines of a scan): the
+    // blocks loaded past pack_cache are freed there, the oldest first
+    void releaseBlocks() const;
+
   private:
-    std::map<Wid, std::unique_ptr<WindowBuffer>> wbuffs;
-    std::map<unsigned int, string> buffer;
-    bool modified_;
-    char cr1=0; // crlf
-    char cr2=0;
+    string swapName() const { return filename_ + ".swp"; }
+    void journalRows();              // record the lines taken until now
+    void journalOp(char op, Cursor::type first, Cursor::type last=0);
+    bool recover();
+    static constexpr uint16_t journal_block = 256;
+    static constexpr uint16_t journal_max = 16384;  // min records before a snapshot
+    bool journaling = false;
+    string journal_;                      // records not written yet
+    std::set<Cursor::type> journal_rows;  // lines taken, not recorded yet
+    uint32_t journal_size = 0;            // bytes of the .swp file
+    uint32_t journal_base = 0;            // bytes of the snapshot in .swp
+    File checkpoint_file;                 // snapshot being written (.swp~)
+    Cursor::type checkpoint_row = 0;      // lines written
+    size_t checkpoint_eols = 0;           // ends of line written (E records)
+    static constexpr uint16_t eols_record = 256;
+    uint32_t checkpoint_size = 0;
+    string checkpoint_tail;               // records since the snapshot started
+
+    using MarkId = uint8_t;  // 'a'..'z', '\'' or a jump (>= jump_ids)
+    static constexpr MarkId jump_ids = 0x80;
+    static constexpr uint8_t jump_max = 100;
+    void placeMark(MarkId, const Cursor&);
+    void removeMark(MarkId);
+    void shiftMarks(Cursor::type from, int32_t delta);  // rows >= from
+    void deleteMarks(Cursor::type first, Cursor::type last);
+    std::map<MarkId, Cursor> marks;
+    std::multimap<Cursor::type, MarkId> mark_rows;
+    std::vector<MarkId> jumps;  // oldest first
+    uint8_t jump_pos = 0;       // jumps.size() when not moving in the list
+    MarkId next_jump = jump_ids;
+
+    struct BracketDepth
+    {
+      int16_t delta;     // opens - closes
+      int16_t fwd_min;   // lowest depth from the start of the line (<= 0)
+      int16_t back_min;  // lowest depth from the end of the line, going back
+    };
+    const BracketDepth& bracketDepth(Cursor::type row, char open, char close) const;
+    void shiftBrackets(Cursor::type from, int32_t delta);
+    static constexpr uint16_t bracket_cache_max = 2048;  // lines
+    mutable std::map<Cursor::type, BracketDepth> bracket_depths;
+    mutable char bracket_open = 0;  // pair of bracket_depths
+
+    // Display columns of a line at every column_step bytes, rebuilt when
+    // the line changes. A few lines are cached (the cursor lines mostly)
+    struct ColumnIndex
+    {
+      Cursor::type row = 0;  // 0 if unused
+      bool ascii = true;     // byte == column
+      std::vector<uint16_t> cols;
+    };
+    static constexpr uint8_t column_step = 32;
+    mutable ColumnIndex column_index[3];
+    mutable uint8_t column_next = 0;
+    const ColumnIndex& columnIndex(Cursor::type row) const;
+    uint8_t tabstop_ = 8;
+
+    // numberDigits() cache, until lines() leaves [digits_min, digits_max]
+    mutable uint8_t digits = 0;
+    mutable int32_t digits_min = 1;
+    mutable int32_t digits_max = 0;
+
+    void syntaxChanged(Cursor::type row);
+
+    // As Vim's syn sync minlines, a row far from the lexed ones is lexed
+    // from syntax_sync lines above it, the lines before lex_first are
+    // assumed to end outside of a string
+    static constexpr Cursor::type syntax_sync = 200;
+    static constexpr Cursor::type syntax_cache = 4096;  // max eol_states
+    void resetSyntax();
+    uint8_t& eolState(Cursor::type row) { return eol_states[row-lex_first]; }
+    uint8_t stateBefore(Cursor::type row) { return row > lex_first ? eolState(row-1) : 0; }
+
+    const Syntax* syntax_ = nullptr;
+    std::vector<uint8_t> eol_states;  // lexer state at end of lines lex_first..lexed
+    Cursor::type lex_first = 1;
+    Cursor::type lexed = 0;
+    Cursor::type stale_first = 1;     // lines to lex again (none if > lexed)
+    Cursor::type stale_last = 0;
+
+    struct DirtyRange
+    {
+      uint32_t version;
+      Cursor::type first;
+      Cursor::type last;
+    };
+    static constexpr uint8_t max_dirty_log = 8;
+    std::list<DirtyRange> dirty_log;
+    uint32_t version_ = 0;
+    uint32_t forgotten_ = 0;  // newest version removed from dirty_log
+
+    // Read only view (-R, :view). The load scans the file once and keeps the
+    // offset of one line every view_step lines. When the index is full the
+    // step doubles, so the memory does not depend on the size of the file.
+    // Lines are read by blocks of view_block lines, from the nearest offset.
+    const string& viewLine(Cursor::type row) const;
+    bool readViewLine(string* line) const;  // false at the end of the file
+    void indexLine(uint32_t offset);        // of line view_done+1
+    static constexpr uint16_t view_index_max = 1024;
+    static constexpr uint8_t view_block = 64;
+    struct ViewBlock
+    {
+      Cursor::type first = 0;  // 0 if unused
+      std::vector<string> lines;
+    };
+    bool view_ = false;
+    bool hex_ = false;
+    static constexpr uint8_t hex_width = 16;  // bytes per row
+    static string hexRow(uint32_t offset, const uint8_t* bytes, size_t n);
+    std::vector<uint32_t> view_index;  // offsets of lines 1, 1+view_step...
+    uint32_t view_step = 16;
+    Cursor::type view_lines = 0;
+    uint32_t view_pos = 0;             // offset scanned
+    bool view_tail = false;            // bytes after the last eol scanned
+    bool view_cr = false;              // a CR is pending
+    uint16_t view_len = 0;             // bytes of the line scanned
+    mutable File view_file;
+    mutable Cursor::type view_row = 0; // next line read from view_file
+    mutable ViewBlock view_blocks[3];
+    mutable uint8_t view_next = 0;
+    Cursor::type view_done = 0;        // lines ended by an eol
+    static constexpr uint8_t follow_max = 128;
+    bool following_ = false;
+    bool follow_sync = false;          // skip to the next eol (mid-line start)
+    bool follow_scan = false;          // io_file is open by poll()
+    std::vector<string> follow_ring;   // last lines up to view_done
+    uint8_t follow_head = 0;           // oldest line of follow_ring
+
+    struct Packed
+    {
+      Cursor::type count;         // lines
+      uint32_t size;              // bytes of the lines, '\n' separated
+      std::vector<uint8_t> data;  // lzf
+      bool loaded = false;        // the lines are in buffer too
+      uint32_t load_us = 0;       // last decompression
+    };
+    // table: lzf_table entries, allocated by pack() only while it packs
+    static constexpr uint8_t lzf_hash_bits = 12;
+    static constexpr uint16_t lzf_table = 1 << lzf_hash_bits;
+    static void lzfPack(const string& in, std::vector<uint8_t>& out, uint16_t* table);
+    static void lzfUnpack(const std::vector<uint8_t>& in, string& out);
+    static constexpr uint8_t pack_lines = 64;
+    static constexpr Cursor::type pack_min = 4096;  // lines of a big buffer
+    static constexpr uint8_t pack_cache = 4;        // blocks loaded
+    std::map<Cursor::type, Packed>::iterator packedAt(Cursor::type row) const;
+    void loadBlock(Cursor::type row) const;  // lines of the block holding row
+    void unloadBlock(Cursor::type first, Packed&) const;
+    bool packBlock(Cursor::type first, Cursor::type last, uint16_t* table);  // false if not worth it
+    void unpack(Cursor::type row);        // the block of row is changed
+    void shiftPacked(Cursor::type from, int32_t delta);
+    bool cold(Cursor::type first, Cursor::type last) const;
+    mutable std::map<Cursor::type, Packed> packed;  // by first row
+    mutable std::vector<Cursor::type> pack_loaded;  // blocks loaded, oldest first (0: gone)
+    Cursor::type pack_next = 1;     // next block to look at
+    mutable bool pack_done = false; // nothing to pack since the last change
+    mutable uint32_t pack_loads = 0;
+    mutable uint32_t pack_load_us = 0;
+    mutable uint32_t pack_load_max = 0;
+
+    std::map<ViewId, std::unique_ptr<WindowBuffer>> wbuffs;
+    mutable std::vector<string> buffer;  // line 1 is buffer[0]
+    bool modified_ = false;
+    bool partial_ = false;  // load was cancelled
+    File io_file;           // being loaded or saved
+    string io_name;         // saved file
+    string io_line;         // line being read
+    uint32_t io_size;
+    // Size and time of filename_ when it was read or saved (write conflicts)
+    void stamp(File& file);
+    bool changedOnDisk();
+    uint32_t disk_size = 0;
+    time_t disk_time = 0;
+    Cursor::type io_row;    // next line to write
+
+    // Any of LF, CR and CRLF ends a line. The end of each line is kept
+    // so that a file is saved with the bytes it was read with.
+    enum Eol : uint8_t { EOL_NONE, EOL_LF, EOL_CR, EOL_CRLF, EOL_SPLIT };
+    // End of line completed by c (cr: a CR is pending), add: c is a byte of a line
+    static Eol endOfLine(char c, bool& cr, bool& add);
+    void pushLine(Eol);  // io_line is read
+    Eol eolOf(Cursor::type row) const;
+    // Longer lines are cut in rows of line_max bytes (EOL_SPLIT: no bytes
+    // between them in the file), the cursor columns are 16 bits
+    static constexpr uint16_t line_max = 4096;
+    Eol eol_ = EOL_NONE;        // of the lines (the first one read)
+    bool eol_last = true;       // the last line has one
+    std::vector<Eol> eols;      // of each line, only if they are not all eol_
+    bool io_cr = false;         // load: a CR is pending
     string filename_;
 };
 
@@ -183,34 +587,99 @@ class Splitter
     Splitter* side_0 = nullptr; // right if vertical, down if not vertical
 };
 
-struct VimSettings
+// Byte stream between a TinyTerm and its link (serial, TCP, WebSocket...)
+// Output is sent by packets of at most packet bytes: when the packet is
+// full, on flush() (Vim flushes after each frame), or delay ms after the
+// first pending byte. Telnet commands (IAC...) are removed from the input.
+class Transport : public Stream
 {
-  static constexpr const char* settings="so,siso,*,ts";
-  uint8_t scrolloff = 5;
-  uint8_t sidescrolloff = 0;
-  uint8_t mode = 0;
-  uint8_t ts = 2;
+  public:
+    struct Options
+    {
+      uint16_t packet;  // bytes per write to the link
+      uint8_t delay;    // ms a partial packet waits for more bytes
+      bool telnet;
+    };
+    static constexpr Options serial_link{64, 0, false};
+    static constexpr Options tcp_link{1460, 20, false};
+    static constexpr Options telnet_link{1460, 20, true};
+    static constexpr Options websocket_link{4096, 20, false};
+
+    Transport(Stream& link, const Options& options) : link(link), options(options) {}
+    void begin();  // the connection is open (telnet: the server echoes, keys come one by one)
+    size_t write(uint8_t c) override { return write(&c, 1); }
+    size_t write(const uint8_t* bytes, size_t n) override;
+    void flush() override;  // bytes the link could not take are kept for the next one
+    void poll();            // sends a partial packet after its delay
+    int available() override;  // also polls
+    int read() override;
+    int peek() override;
+    uint32_t packets() const { return packets_; }
+
+  private:
+    void receive();  // link bytes to input, without the telnet commands
+    Stream& link;
+    Options options;
+    string output;
+    uint32_t output_since = 0;  // millis() of the first pending byte
+    string input;
+    uint8_t iac = 0;            // telnet command being received
+    uint32_t packets_ = 0;
 };
 
 class Vim : public tiny_bash::TinyApp
 {
   public:
-    using Record=std::vector<TinyTerm::KeyCode>;
+    // Keys as bytes, KeyCodes >= 0xFF are escaped (see recordKey)
+    using Record=std::string;
+
+    // Long operation run by slices from loop(), ESC cancels it
+    struct Job
+    {
+      string name;  // shown with the progress in the status line
+      std::function<bool(Job&, uint32_t deadline)> step;  // false when done
+      std::function<void(bool cancelled)> end;
+      uint8_t progress = 0;  // %
+    };
+    void addJob(Job&& job) { jobs.push_back(std::move(job)); }
+    bool busy() const { return jobs.size(); }  // a job is running
+    bool isCommandLine(const Buffer& buff) const { auto it=buffers.find(":"); return it != buffers.end() and it->second.get() == &buff; }
+
+    // Last change, replayed by '.'
+    struct Change
+    {
+      uint32_t count=0;
+      Record command; // normal mode keys (operator + motion)
+      Record text;    // keys typed in insert / replace mode
+    };
+
     enum {
       NORMAL = 0,
       COMMAND = 1,
       INSERT = 2,
       REPLACE = 3,
       EDIT_MODE = 2,  // Mask for replace or insert (editions modes)
+      VISUAL = 4,
+      VISUAL_LINE = 5,
+      VISUAL_BLOCK = 12,
+      VISUAL_MODE = 4,  // Mask for visual modes
     };
 
 
-    Vim(TinyTerm* term, const tiny_bash::TinyEnv& e, string args);
-    ~Vim() = default;
+    // With a link (the Transport term runs on), loop() reads and decodes
+    // the keys, and each frame is sent as soon as it is painted
+    Vim(TinyTerm* term, const tiny_bash::TinyEnv& e, string args, Transport* link=nullptr);
+    ~Vim();
 
     void onKey(TinyTerm::KeyCode) override;
     void onMouse(const TinyTerm::MouseEvent&) override;
     bool onCommand(std::string cmd);
+    // :set name[=value] | noname | invname | name! | name? | all ...
+    // (no allocation, except for the messages)
+    bool set(const char* args, bool local_only=false);
+    void loadRc();
+    bool saveRc();
+    void search(const string& pattern);  // from the cursor, by a job
 
     void loop() override;
     TinyTerm& getTerm() const { return *term; }
@@ -219,27 +688,101 @@ class Vim : public tiny_bash::TinyApp
 
     void clip(const std::string&);
     const std::string& clipboard() const { return clipboard_; }
+    // Last f/t/F/T, repeated by ; and ,
+    struct Find { Action action = Action::VIM_UNKNOWN; char c = 0; };
+    Find last_find;
     void setMode(uint8_t);
+    void toggleMode(uint8_t mode) { setMode(settings.mode==mode ? (uint8_t)NORMAL : mode); }
     void redraw();
 
+    // While suspended, windows only collect dirty rows,
+    // they are painted by the last resumeRender()
+    void suspendRender() { suspended++; }
+    void resumeRender();
+    bool isSuspended() const { return suspended; }
+
   private:
     void drawSplitter();
-    void play(const Record&, uint8_t count);
+    void render();  // paint all windows changes, then focus the current one
+    void dispatch(TinyTerm::KeyCode);
+    void quit();
+    void play(const Record&, uint32_t count=1);
+    void play(const Change&, uint32_t count);
+    void onRegister(Action, char reg, uint32_t count);
+    void onOperator();  // scmd is d c y...
+    void endChange();
+    void load(Buffer&, const string& file, bool recovering, Buffer::Mode mode=Buffer::EDIT);
+    bool view(const string& file, Buffer::Mode mode);  // :view :hex in the current window
+    void showBuffer(Buffer&);  // in the current window
+    void loadTo(Buffer&, Cursor::type row);  // now, not waiting for the job
+    bool save(Buffer&, const string& file, bool force, bool quit_after);
+    void checkpoint(Buffer&);  // by a job
+    void validateCursors();
+    void cancelJobs();
+    void message(const string&, bool is_error=false);  // in the command line
+    bool setOne(const char* arg, size_t len, Buffer*, bool local_only);
+    // Ex range ([addr][,addr] or %), returns the count of addresses or -1
+    int8_t getRange(string& cmd, const Buffer&, Cursor::type cur, Cursor::type& first, Cursor::type& last);
+    void showSettings(bool all);
     bool calcWindow(Wid, Window&);
     void error(const char*);
     Action getAction(const char* command);
 
     WindowBuffer* getWBuff(Wid);
-    std::map<string, Buffer> buffers;
+    // Sessions (Vim instances, a serial console and a telnet one...) share
+    // the buffers of the same files, each one with its own windows
+    Buffer& openBuffer(const string& name, bool& shared);
+    ViewId viewId(Wid wid) const { return (ViewId)session << 16 | wid; }
+    static std::map<string, std::weak_ptr<Buffer>> shared_buffers;
+    static uint16_t sessions;
+    uint16_t session;
+    std::map<string, std::shared_ptr<Buffer>> buffers;
     Splitter splitter;
     Wid curwid;
     TinyTerm* term;
-    uint8_t rpt_count=0;
+    Transport* link;
+    string received;        // link bytes, an escape sequence may be incomplete
+    uint32_t received_at=0; // millis() of the last link byte
+    static constexpr uint8_t esc_delay = 10;  // ms for the rest of an escape sequence
+    void receive();
+    void onSequence(const string& params, char final);  // ESC [ params final
+    uint32_t rpt_count=0;
     bool last_was_digit=false;
-    Record  record;
     bool playing=false;
+    bool quitting=false;
+    uint8_t suspended=0;
+    bool waiting_key=false; // a listing is shown until a key is hit
+    bool literal_next=false;  // Ctrl-V in insert mode, the next key is text
+    bool settings_changed=false;
+    static constexpr uint16_t journal_delay = 1000;  // ms without a key
+    uint32_t last_key=0;    // millis() of the last key
+    // A paste is inserted at once with a single repaint. Keys decoded from
+    // a link use bracketed paste (ESC [200~ text ESC [201~). Otherwise text
+    // keys faster than paste_gap in insert mode are a paste, and the first
+    // one waits for the gap before being dispatched alone.
+    static constexpr uint8_t paste_gap = 3;  // ms
+    string paste;
+    bool pasting=false;     // between ESC [200~ and ESC [201~
+    bool bracketed=false;   // the terminal brackets its pastes, no timing
+    void endPaste();        // a lone key is dispatched, more are inserted
+    void endBracketedPaste();
+    void insertPaste();
+    static constexpr uint16_t follow_poll = 500;  // ms between two size checks
+    uint32_t last_poll=0;
+    Change change;          // change being typed
+    Change last_change;
+    bool changing=false;    // change.text is being recorded
+    std::map<char, Record> registers;
+    char macro_reg=0;       // register being recorded (q)
+    char last_reg=0;        // last played register (@@)
+    Action reg_action=Action::VIM_UNKNOWN;  // q/@ waiting for register name
+    uint32_t reg_count=0;
+    uint32_t op_count=0;    // typed after an operator
     std::string scmd;
     std::string clipboard_;
+    std::string search_;    // last searched pattern (n)
+    std::list<Job> jobs;    // the first one runs
+    static constexpr uint8_t job_slice = 20;  // ms per loop()
 };
 
 }